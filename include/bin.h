@@ -0,0 +1,14 @@
+/*
+ * Binary counterparts of the json mapping. Documents have the same
+ * {"magic", "version", "header", "entries"} layout, field and enum names
+ * as json ones, but bytes fields are kept as native byte strings.
+ */
+enum {
+	FMT_JSON,
+	FMT_CBOR,
+	FMT_MSGPACK,
+};
+
+extern int parse_format(const char *str);
+extern int img_to_bin(const char *in, const char *out, int fmt);
+extern int bin_to_img(const char *in, const char *out, int fmt);
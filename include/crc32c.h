@@ -0,0 +1,8 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/* crc32c_init() has to be called once before crc32c() is used */
+extern void crc32c_init(void);
+extern uint32_t crc32c(const void *data, size_t len);
+/* Continues crc of the data before, crc32c(a + b) == update(crc32c(a), b) */
+extern uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
@@ -80,65 +80,4 @@ struct criu_image_info {
 #define SINGLE(name, entry_name) { name##_MAGIC, false, PB_INFO(entry_name), NULL } //FIXME do i need to add , after NULL ?
 #define ARRAY(name, entry_name) { name##_MAGIC, true, PB_INFO(entry_name), PB_INFO(entry_name) }
 
-struct criu_image_info img_infos [] = {
-	SINGLE( INVENTORY,	inventory_entry 	),
-	SINGLE( CORE,		core_entry		),
-	SINGLE( IDS,		task_kobj_ids_entry	),
-	SINGLE( CREDS,		creds_entry		),
-	SINGLE( UTSNS,		utsns_entry		),
-	SINGLE( IPC_VAR,	ipc_var_entry		),
-	SINGLE( FS,		fs_entry		),
-	SINGLE( GHOST_FILE,	ghost_file_entry	),
-	SINGLE( MM,		mm_entry		),
-	SINGLE( CGROUP,		cgroup_entry		),
-	SINGLE( TCP_STREAM,	tcp_stream_entry	),
-	SINGLE( STATS,		stats_entry		),
-
-	ARRAY( PSTREE,		pstree_entry		),
-	ARRAY( REG_FILES,	reg_file_entry		),
-	ARRAY( NS_FILES,	ns_file_entry		),
-	ARRAY( EVENTFD_FILE,	eventfd_file_entry	),
-	ARRAY( EVENTPOLL_FILE,	eventpoll_file_entry	),
-	ARRAY( EVENTPOLL_TFD,	eventpoll_tfd_entry	),
-	ARRAY( SIGNALFD,	signalfd_entry		),
-	ARRAY( TIMERFD,		timerfd_entry		),
-	ARRAY( INOTIFY_FILE,	inotify_file_entry	),
-	ARRAY( INOTIFY_WD,	inotify_wd_entry	),
-	ARRAY( FANOTIFY_FILE,	fanotify_file_entry	),
-	ARRAY( FANOTIFY_MARK,	fanotify_mark_entry	),
-	ARRAY( VMAS,		vma_entry		),
-	ARRAY( PIPES,		pipe_entry		),
-	ARRAY( FIFO,		fifo_entry		),
-	ARRAY( SIGACT,		sa_entry		),
-	ARRAY( NETLINK_SK,	netlink_sk_entry	),
-	ARRAY( REMAP_FPATH,	remap_file_path_entry	),
-	ARRAY( MNTS,		mnt_entry		),
-	ARRAY( TTY_FILES,	tty_file_entry		),
-	ARRAY( TTY_INFO,	tty_info_entry		),
-	ARRAY( RLIMIT,		rlimit_entry		),
-	ARRAY( TUNFILE,		tunfile_entry		),
-	ARRAY( EXT_FILES,	ext_file_entry		),
-	ARRAY( IRMAP_CACHE,	irmap_cache_entry	),
-	ARRAY( FILE_LOCKS,	file_lock_entry		),
-	ARRAY( FDINFO,		fdinfo_entry		),
-	ARRAY( UNIXSK,		unix_sk_entry		),
-	ARRAY( INETSK,		inet_sk_entry		),
-	ARRAY( PACKETSK,	packet_sock_entry	),
-	ARRAY( ITIMERS,		itimer_entry		),
-	ARRAY( POSIX_TIMERS,	posix_timer_entry	),
-	ARRAY( NETDEV,		net_device_entry	),
-	ARRAY( PIPES_DATA,	pipe_data_entry		),
-	ARRAY( FIFO_DATA,	pipe_data_entry		),
-	ARRAY( SK_QUEUES,	sk_packet_entry		),
-	ARRAY( IPCNS_SHM,	ipc_shm_entry		),
-	ARRAY( IPCNS_SEM,	ipc_sem_entry		),
-	ARRAY( IPCNS_MSG,	ipc_msg_entry		),
-
-	/*
-	 * This one is the special one. It has header pagemap_head
-	 * that is followed by an array of pagemap_entry msgs
-	 */
-	{ PAGEMAP_MAGIC, true, PB_INFO(pagemap_head), PB_INFO(pagemap_entry) },
-
-	{}
-};
+extern struct criu_image_info img_infos[];
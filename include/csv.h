@@ -0,0 +1 @@
+extern int img_to_csv(char msg[], char src[], char out[]);
@@ -0,0 +1 @@
+extern int fsck_imgs(char src[], char sums[]);
@@ -0,0 +1,87 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <jansson.h>
+#include <google/protobuf-c/protobuf-c.h>
+
+struct protobuf_info;
+struct criu_image_info;
+
+extern struct criu_image_info *find_img_info(uint32_t magic);
+/* Message descriptor by name, e.g. "vma_entry", among known images */
+extern const ProtobufCMessageDescriptor *find_msg_desc(const char *msg);
+/*
+ * Image and json arguments may be "-" for stdin/stdout or "fd:N" for an
+ * inherited descriptor, so conversions can be chained through pipes.
+ * Nothing here seeks, short reads and writes of pipes are retried.
+ */
+extern int img_open(const char *path, int flags);
+extern FILE *img_fopen(const char *path, const char *mode);
+extern ssize_t read_all(int fd, void *buf, size_t len);
+extern int write_all(int fd, const void *buf, size_t len);
+/* Reads everything up to EOF into mem_alloc()-ed buffer */
+extern int read_fd_all(int fd, void **buf, size_t *size);
+/*
+ * Forwards len bytes (all up to EOF if len < 0) from fd_in to fd_out with
+ * splice() when one of them is a pipe, copying them otherwise.
+ */
+extern int img_splice(int fd_in, int fd_out, long long len);
+
+extern int read_pb_buf(int fd, void **buf, int *size);
+extern int read_pb(int fd, void **pb, struct protobuf_info *info);
+
+/*
+ * Fills paths with SRC itself if it's a file or with all *.img files
+ * in it if it's a directory. Returns number of paths or -1.
+ */
+extern int img_list(const char *src, char ***paths);
+extern void img_list_free(char **paths, int n);
+/* Whether a directory entry is an image img_list() would return */
+extern bool img_name_listed(const char *name);
+/*
+ * Dump directories also hold non-protobuf images (tmpfs tarballs, route
+ * and iptables dumps), images with unknown magic are skipped there
+ * instead of failing the whole run.
+ */
+extern bool img_is_dir(const char *src);
+
+/*
+ * Image json layout is
+ *
+ *	{"magic": M, "version": 2, "header": {...}, "entries": [...]}
+ *
+ * "header" is there for single message images and for images whose
+ * first message differs from the rest (pagemap), "entries" holds the
+ * array messages in order. Old {"magic": M, "0": ..., "1": ...} layout
+ * is still accepted on input.
+ *
+ * img_json_entry() returns message #i of either layout (header being #0
+ * when present) or NULL if there is no such message.
+ */
+#define IMG_JSON_VERSION	2
+
+extern json_t *img_json_entry(json_t *js, int i);
+extern bool img_has_header(struct criu_image_info *info);
+
+extern int img_read_json(int fd, json_t **js);
+/*
+ * Writes what json_dumpf() of img_read_json() result with flags would,
+ * but dumps entries one by one as they are read instead of building the
+ * whole json in memory.
+ */
+extern int img_stream_json(int fd, FILE *f, size_t flags);
+/*
+ * to-json --string-dict: img_stream_json() dumps string fields as indexes
+ * into "strings": [...] added at the end of the document, so that each
+ * string is stored once per image. img_write_json() resolves them back.
+ */
+extern bool img_string_dict;
+extern int img_load_json(const char *path, json_t **js);
+extern int img_write_json(json_t *js, int fd_out);
+/* Packs json of a message into mem_alloc()-ed buffer as size + message */
+extern int img_pack_json(struct protobuf_info *pb_info, json_t *js, void **buf, size_t *len);
+
+/* File to file conversions behind to-json and to-img */
+extern int img_to_json(const char *in, const char *out);
+extern int json_to_img(const char *in, const char *out);
@@ -0,0 +1,26 @@
+#include <stdbool.h>
+#include <jansson.h>
+
+/*
+ * Repeated strings (paths, names, enum values) of json trees that are
+ * kept around (tree mode, whole images loaded into memory) are converted
+ * into one shared json string node per thread instead of a new node every
+ * time. Interning is off unless the thread turned it on with
+ * intern_enable(), which returns the previous state. Interned nodes live
+ * until the thread exits, or until intern_fini() for the main thread.
+ */
+extern json_t *json_string_interned(const char *str);
+extern bool intern_enable(bool on);
+extern void intern_fini(void);
+
+/*
+ * String dictionary of to-json --string-dict. Every string up to a
+ * length is kept once and referred to by its index, strings that don't
+ * fit get -1 and are dumped in place.
+ */
+struct intern_dict;
+
+extern struct intern_dict *intern_dict_new(void);
+extern int intern_dict_add(struct intern_dict *d, const char *str);
+extern const char **intern_dict_strings(struct intern_dict *d, unsigned int *nr);
+extern void intern_dict_free(struct intern_dict *d);
@@ -0,0 +1,28 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <google/protobuf-c/protobuf-c.h>
+
+/*
+ * All jansson and protobuf-c allocations, as well as our own arrays and
+ * buffers, go through mem_alloc() so that the whole conversion can be kept
+ * within --max-memory budget. When the budget is exhausted allocations fail
+ * instead of the process being OOM-killed.
+ */
+extern ProtobufCAllocator pb_allocator;
+
+extern void mem_init(void);
+extern int parse_size(const char *str, size_t *size);
+extern int mem_set_limit(const char *str);
+extern bool mem_pressure(void);
+
+extern void *mem_alloc(size_t size);
+extern void *mem_calloc(size_t nmemb, size_t size);
+extern void *mem_realloc(void *ptr, size_t size);
+extern void mem_free(void *ptr);
+extern char *mem_strdup(const char *str);
+
+/* --mem-profile accounting of allocations to phase and message type */
+extern int mem_set_profile(const char *path);
+extern int mem_tag(const char *phase, const char *msg);
+extern void mem_untag(int prev);
+extern void mem_report(void);
@@ -0,0 +1 @@
+extern int pagemap_chain(char dir[], char out[]);
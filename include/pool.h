@@ -0,0 +1,21 @@
+/*
+ * Tiny worker pool. run_parallel() calls fn(arg, i) for every i in
+ * [0, nr_jobs) on up to nr_workers() threads and returns -1 if any of
+ * the calls failed.
+ */
+typedef int (*pool_fn_t)(void *arg, int idx);
+
+extern int nr_workers(void);
+extern int run_parallel(int nr_jobs, pool_fn_t fn, void *arg);
+
+/*
+ * Long living version of the above for jobs that show up over time.
+ * wq_queue() hands job to one of the workers calling fn(arg, job),
+ * wq_stop() waits for all queued jobs and returns -1 if any failed.
+ */
+typedef int (*wq_fn_t)(void *arg, void *job);
+struct workqueue;
+
+extern struct workqueue *wq_start(wq_fn_t fn, void *arg);
+extern int wq_queue(struct workqueue *wq, void *job);
+extern int wq_stop(struct workqueue *wq);
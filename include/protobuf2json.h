@@ -1,5 +1,28 @@
+#include <stdbool.h>
 #include <jansson.h>
 #include <google/protobuf-c/protobuf-c.h>
 
+struct intern_dict;
+
 extern int protobuf_to_json(const ProtobufCMessageDescriptor *pb_desc, const void *pb, json_t **js);
 extern int json_to_protobuf(const ProtobufCMessageDescriptor *pb_desc, json_t *js, void **pb);
+extern size_t get_size_of_pb_type(ProtobufCType type);
+extern bool pb_field_present(const ProtobufCFieldDescriptor *fd, const void *pb);
+
+/*
+ * Writes exactly what json_dumpf(js, f, flags) would write for the json
+ * protobuf_to_json() builds, without building it. depth is the nesting
+ * level the message sits at, it matters for JSON_INDENT() only.
+ */
+extern int protobuf_dump_json(const ProtobufCMessageDescriptor *pb_desc, const void *pb,
+			      FILE *f, size_t flags, int depth);
+/* Whitespace jansson puts between values at depth */
+extern void json_dump_indent(FILE *f, size_t flags, int depth, bool space);
+
+/*
+ * --string-dict: while set for the calling thread, string fields are
+ * dumped as indexes into dict, and integers in place of strings are
+ * looked up in strings array on load.
+ */
+extern void pb_dump_dict(struct intern_dict *dict);
+extern void pb_load_dict(json_t *strings);
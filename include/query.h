@@ -0,0 +1,2 @@
+extern int query_imgs(char expr[], char src[]);
+extern int filter_img(char expr[], char in[], char out[]);
@@ -0,0 +1,8 @@
+/*
+ * to-json --shard-size splits entries of image in into shard files
+ * out.0, out.1, ... of about shard_size bytes each and writes manifest
+ * listing them to out. shards_to_img() is what to-img does with such a
+ * manifest js loaded from path manifest.
+ */
+extern int img_to_shards(const char *in, const char *out, size_t shard_size);
+extern int shards_to_img(json_t *js, const char *manifest, int fd_out);
@@ -0,0 +1 @@
+extern int tree_to_json(char dir[], char out[]);
@@ -0,0 +1 @@
+extern int verify_imgs(char src[]);
@@ -0,0 +1 @@
+extern int watch_dir(char dir[], char out[]);
@@ -0,0 +1,1176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "protobuf2json.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "bin.h"
+
+/*
+ * Output is encoded into a buffer which is flushed to fd when it fills
+ * up, so that only one entry at a time is kept in memory
+ */
+#define BIN_BUF_SIZE	(64 << 10)
+
+struct bin_buf {
+	int		fmt;
+	int		fd;
+	uint8_t		*data;
+	size_t		len;
+	size_t		size;
+	bool		err;
+};
+
+int parse_format(const char *str)
+{
+	if (!strcmp(str, "json"))
+		return FMT_JSON;
+	if (!strcmp(str, "cbor"))
+		return FMT_CBOR;
+	if (!strcmp(str, "msgpack"))
+		return FMT_MSGPACK;
+
+	pr_err("Unknown format %s\n", str);
+	return -1;
+}
+
+static void buf_flush(struct bin_buf *b)
+{
+	if (!b->err && write_all(b->fd, b->data, b->len))
+		b->err = true;
+	b->len = 0;
+}
+
+static void buf_put(struct bin_buf *b, const void *ptr, size_t n)
+{
+	if (b->err)
+		return;
+
+	if (b->len + n > b->size && b->len) {
+		buf_flush(b);
+		if (b->err)
+			return;
+	}
+
+	/* Only items bigger than the buffer get here after a flush */
+	if (b->len + n > b->size) {
+		size_t size = b->size ? b->size : BIN_BUF_SIZE;
+		uint8_t *data;
+
+		while (size < b->len + n)
+			size *= 2;
+
+		data = mem_realloc(b->data, size);
+		if (!data) {
+			pr_err("Can't grow output buffer\n");
+			b->err = true;
+			return;
+		}
+
+		b->data = data;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, ptr, n);
+	b->len += n;
+}
+
+static void buf_put_byte(struct bin_buf *b, uint8_t byte)
+{
+	buf_put(b, &byte, 1);
+}
+
+static void buf_put_be(struct bin_buf *b, uint64_t val, int n)
+{
+	uint8_t be[8];
+	int i;
+
+	for (i = 0; i < n; i++)
+		be[i] = val >> (8 * (n - 1 - i));
+
+	buf_put(b, be, n);
+}
+
+/* CBOR item head, major type and argument */
+static void cbor_put_head(struct bin_buf *b, int major, uint64_t val)
+{
+	if (val < 24)
+		buf_put_byte(b, major << 5 | val);
+	else if (val <= 0xff) {
+		buf_put_byte(b, major << 5 | 24);
+		buf_put_be(b, val, 1);
+	} else if (val <= 0xffff) {
+		buf_put_byte(b, major << 5 | 25);
+		buf_put_be(b, val, 2);
+	} else if (val <= 0xffffffff) {
+		buf_put_byte(b, major << 5 | 26);
+		buf_put_be(b, val, 4);
+	} else {
+		buf_put_byte(b, major << 5 | 27);
+		buf_put_be(b, val, 8);
+	}
+}
+
+/*
+ * msgpack length prefixed item: fix form when there is one and it fits,
+ * then 8 (when there is one), 16 and 32 bit length forms.
+ */
+static void msgpack_put_len(struct bin_buf *b, uint8_t fix, size_t fix_max,
+			    uint8_t code8, uint8_t code16, uint8_t code32, size_t len)
+{
+	if (fix && len <= fix_max)
+		buf_put_byte(b, fix | len);
+	else if (code8 && len <= 0xff) {
+		buf_put_byte(b, code8);
+		buf_put_be(b, len, 1);
+	} else if (len <= 0xffff) {
+		buf_put_byte(b, code16);
+		buf_put_be(b, len, 2);
+	} else {
+		buf_put_byte(b, code32);
+		buf_put_be(b, len, 4);
+	}
+}
+
+static void put_uint(struct bin_buf *b, uint64_t val)
+{
+	if (b->fmt == FMT_CBOR) {
+		cbor_put_head(b, 0, val);
+		return;
+	}
+
+	if (val < 0x80)
+		buf_put_byte(b, val);
+	else if (val <= 0xff) {
+		buf_put_byte(b, 0xcc);
+		buf_put_be(b, val, 1);
+	} else if (val <= 0xffff) {
+		buf_put_byte(b, 0xcd);
+		buf_put_be(b, val, 2);
+	} else if (val <= 0xffffffff) {
+		buf_put_byte(b, 0xce);
+		buf_put_be(b, val, 4);
+	} else {
+		buf_put_byte(b, 0xcf);
+		buf_put_be(b, val, 8);
+	}
+}
+
+static void put_int(struct bin_buf *b, int64_t val)
+{
+	if (val >= 0) {
+		put_uint(b, val);
+		return;
+	}
+
+	if (b->fmt == FMT_CBOR) {
+		cbor_put_head(b, 1, -1 - val);
+		return;
+	}
+
+	if (val >= -32)
+		buf_put_byte(b, (uint8_t)val);
+	else if (val >= INT8_MIN) {
+		buf_put_byte(b, 0xd0);
+		buf_put_be(b, val, 1);
+	} else if (val >= INT16_MIN) {
+		buf_put_byte(b, 0xd1);
+		buf_put_be(b, val, 2);
+	} else if (val >= INT32_MIN) {
+		buf_put_byte(b, 0xd2);
+		buf_put_be(b, val, 4);
+	} else {
+		buf_put_byte(b, 0xd3);
+		buf_put_be(b, val, 8);
+	}
+}
+
+static void put_str(struct bin_buf *b, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (b->fmt == FMT_CBOR)
+		cbor_put_head(b, 3, len);
+	else
+		msgpack_put_len(b, 0xa0, 31, 0xd9, 0xda, 0xdb, len);
+	buf_put(b, str, len);
+}
+
+static void put_bytes(struct bin_buf *b, const uint8_t *data, size_t len)
+{
+	if (b->fmt == FMT_CBOR)
+		cbor_put_head(b, 2, len);
+	else
+		msgpack_put_len(b, 0, 0, 0xc4, 0xc5, 0xc6, len);
+	buf_put(b, data, len);
+}
+
+static void put_array(struct bin_buf *b, size_t n)
+{
+	if (b->fmt == FMT_CBOR)
+		cbor_put_head(b, 4, n);
+	else
+		msgpack_put_len(b, 0x90, 15, 0, 0xdc, 0xdd, n);
+}
+
+/*
+ * Array of entries is written before they are counted. CBOR has indefinite
+ * length arrays for that, msgpack needs the number of entries up front.
+ */
+static void put_entries(struct bin_buf *b, size_t n)
+{
+	if (b->fmt == FMT_CBOR)
+		buf_put_byte(b, 0x9f);
+	else
+		put_array(b, n);
+}
+
+static void put_entries_end(struct bin_buf *b)
+{
+	if (b->fmt == FMT_CBOR)
+		buf_put_byte(b, 0xff);
+}
+
+static void put_map(struct bin_buf *b, size_t n)
+{
+	if (b->fmt == FMT_CBOR)
+		cbor_put_head(b, 5, n);
+	else
+		msgpack_put_len(b, 0x80, 15, 0, 0xde, 0xdf, n);
+}
+
+static void put_bool(struct bin_buf *b, bool val)
+{
+	if (b->fmt == FMT_CBOR)
+		buf_put_byte(b, val ? 0xf5 : 0xf4);
+	else
+		buf_put_byte(b, val ? 0xc3 : 0xc2);
+}
+
+static void put_float(struct bin_buf *b, float val)
+{
+	uint32_t raw;
+
+	memcpy(&raw, &val, sizeof(raw));
+	buf_put_byte(b, b->fmt == FMT_CBOR ? 0xfa : 0xca);
+	buf_put_be(b, raw, 4);
+}
+
+static void put_double(struct bin_buf *b, double val)
+{
+	uint64_t raw;
+
+	memcpy(&raw, &val, sizeof(raw));
+	buf_put_byte(b, b->fmt == FMT_CBOR ? 0xfb : 0xcb);
+	buf_put_be(b, raw, 8);
+}
+
+static int pb_to_bin(const ProtobufCMessageDescriptor *desc, const void *pb,
+		     struct bin_buf *b);
+
+static int pb_value_to_bin(const ProtobufCFieldDescriptor *fd, const void *val,
+			   struct bin_buf *b)
+{
+	switch (fd->type) {
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+		put_int(b, *(int32_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_FIXED32:
+		put_uint(b, *(uint32_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+		put_int(b, *(int64_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_FIXED64:
+		put_uint(b, *(uint64_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_FLOAT:
+		put_float(b, *(float *)val);
+		break;
+	case PROTOBUF_C_TYPE_DOUBLE:
+		put_double(b, *(double *)val);
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		put_bool(b, *(protobuf_c_boolean *)val);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+		{
+		const ProtobufCEnumValue *pb_enum_val;
+
+		pb_enum_val = protobuf_c_enum_descriptor_get_value(fd->descriptor, *(int *)val);
+		if (!pb_enum_val) {
+			pr_err("Unknown enum value\n");
+			return -1;
+		}
+
+		put_str(b, pb_enum_val->name);
+		break;
+		}
+	case PROTOBUF_C_TYPE_STRING:
+		put_str(b, *(char **)val);
+		break;
+	case PROTOBUF_C_TYPE_BYTES:
+		{
+		const ProtobufCBinaryData *pb_bin = val;
+
+		put_bytes(b, pb_bin->data, pb_bin->len);
+		break;
+		}
+	case PROTOBUF_C_TYPE_MESSAGE:
+		{
+		const ProtobufCMessage *pb = *(const ProtobufCMessage **)val;
+
+		return pb_to_bin(pb->descriptor, pb, b);
+		}
+	default:
+		pr_err("Unknown field type\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pb_to_bin(const ProtobufCMessageDescriptor *desc, const void *pb,
+		     struct bin_buf *b)
+{
+	size_t n = 0, j;
+	int i;
+
+	for (i = 0; i < desc->n_fields; i++)
+		if (pb_field_present(desc->fields + i, pb))
+			n++;
+
+	put_map(b, n);
+
+	for (i = 0; i < desc->n_fields; i++) {
+		const ProtobufCFieldDescriptor *fd = desc->fields + i;
+		const void *pb_field = pb + fd->offset;
+
+		if (!pb_field_present(fd, pb))
+			continue;
+
+		put_str(b, fd->name);
+
+		if (fd->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t n_values = *(const size_t *)(pb + fd->quantifier_offset);
+			size_t value_size = get_size_of_pb_type(fd->type);
+			const void *arr = *(const void * const *)pb_field;
+
+			put_array(b, n_values);
+			for (j = 0; j < n_values; j++)
+				if (pb_value_to_bin(fd, arr + j * value_size, b))
+					return -1;
+		} else if (pb_value_to_bin(fd, pb_field, b))
+			return -1;
+	}
+
+	return b->err ? -1 : 0;
+}
+
+/* msgpack has no indefinite length arrays, count entries by skipping over them */
+static int count_entries(int fd, size_t *nr)
+{
+	off_t start;
+	ssize_t ret;
+	int size;
+
+	start = lseek(fd, 0, SEEK_CUR);
+	if (start < 0) {
+		pr_perror("Can't count entries, msgpack needs seekable input");
+		return -1;
+	}
+
+	for (*nr = 0; ; (*nr)++) {
+		ret = read_all(fd, &size, sizeof(size));
+		if (ret == 0)
+			break;
+		if (ret != sizeof(size) || size < 0 || lseek(fd, size, SEEK_CUR) < 0) {
+			pr_err("Can't read size of protobuf message\n");
+			return -1;
+		}
+	}
+
+	if (lseek(fd, start, SEEK_SET) < 0) {
+		pr_perror("Can't rewind input");
+		return -1;
+	}
+
+	return 0;
+}
+
+int img_to_bin(const char *in, const char *out, int fmt)
+{
+	struct bin_buf b = { .fmt = fmt, .fd = -1 };
+	struct criu_image_info *info;
+	struct protobuf_info *pb_info;
+	size_t nr_entries = 0;
+	bool has_header;
+	void *obj = NULL;
+	uint32_t magic;
+	int fd_in, i, ret = -1, tag, rd;
+
+	fd_in = img_open(in, O_RDONLY);
+	if (fd_in < 0)
+		return -1;
+
+	tag = mem_tag("to-bin", NULL);
+
+	if (read_all(fd_in, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_perror("Can't read magic from input file");
+		goto out;
+	}
+
+	info = find_img_info(magic);
+	if (!info) {
+		pr_err("Unknown magic\n");
+		goto out;
+	}
+
+	has_header = img_has_header(info);
+
+	if (info->is_array && fmt == FMT_MSGPACK) {
+		if (count_entries(fd_in, &nr_entries))
+			goto out;
+		if (has_header && nr_entries)
+			nr_entries--;
+	}
+
+	/* The first message decides whether there is a header key */
+	pb_info = &info->header_info;
+	rd = read_pb(fd_in, &obj, pb_info);
+	if (rd < 0)
+		goto out;
+
+	b.fd = img_open(out, O_WRONLY | O_CREAT | O_TRUNC);
+	if (b.fd < 0)
+		goto out;
+
+	put_map(&b, 2 + (has_header && rd) + info->is_array);
+	put_str(&b, "magic");
+	put_uint(&b, magic);
+	put_str(&b, "version");
+	put_uint(&b, IMG_JSON_VERSION);
+
+	if (has_header && rd) {
+		put_str(&b, "header");
+		rd = pb_to_bin(pb_info->desc, obj, &b);
+		pb_info->free(obj, &pb_allocator);
+		obj = NULL;
+		if (rd) {
+			pr_err("Can't convert header\n");
+			goto out;
+		}
+	}
+
+	if (info->is_array) {
+		put_str(&b, "entries");
+		put_entries(&b, nr_entries);
+
+		for (i = has_header; ; i++) {
+			/* images without header have their first message read already */
+			if (!obj) {
+				pb_info = &info->extra_info;
+				rd = read_pb(fd_in, &obj, pb_info);
+				if (rd < 0)
+					goto out;
+				else if (rd == 0)
+					break;
+			}
+
+			rd = pb_to_bin(pb_info->desc, obj, &b);
+			pb_info->free(obj, &pb_allocator);
+			obj = NULL;
+			if (rd) {
+				pr_err("Can't convert entry #%d\n", i);
+				goto out;
+			}
+		}
+
+		put_entries_end(&b);
+	}
+
+	buf_flush(&b);
+	if (b.err)
+		goto out;
+
+	ret = 0;
+out:
+	if (obj)
+		pb_info->free(obj, &pb_allocator);
+	mem_free(b.data);
+	if (b.fd >= 0)
+		close(b.fd);
+	close(fd_in);
+	mem_untag(tag);
+	return ret;
+}
+
+enum {
+	BIN_INT,
+	BIN_STR,
+	BIN_BYTES,
+	BIN_ARRAY,
+	BIN_MAP,
+	BIN_BOOL,
+	BIN_FLOAT,
+	BIN_NULL,
+	BIN_BREAK,
+};
+
+struct bin_item {
+	int		type;
+	bool		indef;	/* cbor array of unknown length, ends with BIN_BREAK */
+	uint64_t	u;	/* integers in two's complement, bool, lengths */
+	double		d;
+	const uint8_t	*data;
+};
+
+struct bin_reader {
+	int		fmt;
+	const uint8_t	*p;
+	const uint8_t	*end;
+};
+
+static int get_be(struct bin_reader *r, int n, uint64_t *val)
+{
+	int i;
+
+	if (r->end - r->p < n) {
+		pr_err("Truncated input\n");
+		return -1;
+	}
+
+	for (*val = 0, i = 0; i < n; i++)
+		*val = *val << 8 | *r->p++;
+
+	return 0;
+}
+
+static int get_data(struct bin_reader *r, struct bin_item *it)
+{
+	if (r->end - r->p < it->u) {
+		pr_err("Truncated input\n");
+		return -1;
+	}
+
+	it->data = r->p;
+	r->p += it->u;
+	return 0;
+}
+
+/* IEEE 754 half precision, exact in a double */
+static double half_to_double(uint16_t half)
+{
+	uint64_t raw = (uint64_t)(half >> 15) << 63;
+	int exp = half >> 10 & 0x1f, mant = half & 0x3ff;
+	double d;
+
+	if (exp == 0) {
+		d = mant / 16777216.0;	/* zero and subnormals, mant * 2^-24 */
+		return raw ? -d : d;
+	}
+
+	raw |= (uint64_t)(exp == 0x1f ? 0x7ff : exp - 15 + 1023) << 52;
+	raw |= (uint64_t)mant << 42;
+	memcpy(&d, &raw, sizeof(d));
+	return d;
+}
+
+static int get_float(struct bin_reader *r, int n, struct bin_item *it)
+{
+	uint64_t raw;
+
+	if (get_be(r, n, &raw))
+		return -1;
+
+	if (n == 2)
+		it->d = half_to_double(raw);
+	else if (n == 4) {
+		uint32_t raw32 = raw;
+		float f;
+
+		memcpy(&f, &raw32, sizeof(f));
+		it->d = f;
+	} else
+		memcpy(&it->d, &raw, sizeof(it->d));
+
+	it->type = BIN_FLOAT;
+	return 0;
+}
+
+static int cbor_get_item(struct bin_reader *r, struct bin_item *it)
+{
+	static const int types[] = { BIN_INT, BIN_INT, BIN_BYTES, BIN_STR, BIN_ARRAY, BIN_MAP };
+	uint8_t byte, major, minor;
+
+	if (r->p == r->end) {
+		pr_err("Truncated input\n");
+		return -1;
+	}
+
+	byte = *r->p++;
+	major = byte >> 5;
+	minor = byte & 0x1f;
+	it->indef = false;
+
+	if (major == 7) {
+		switch (minor) {
+		case 20:
+		case 21:
+			it->type = BIN_BOOL;
+			it->u = minor == 21;
+			return 0;
+		case 22:
+			it->type = BIN_NULL;
+			return 0;
+		case 25:
+			return get_float(r, 2, it);
+		case 26:
+			return get_float(r, 4, it);
+		case 27:
+			return get_float(r, 8, it);
+		case 31:
+			it->type = BIN_BREAK;
+			return 0;
+		}
+		pr_err("Unsupported cbor simple value %#x\n", byte);
+		return -1;
+	}
+
+	if (major == 4 && minor == 31) {
+		it->type = BIN_ARRAY;
+		it->indef = true;
+		return 0;
+	}
+
+	if (major == 6 || minor > 27) {
+		pr_err("Unsupported cbor item %#x\n", byte);
+		return -1;
+	}
+
+	if (minor < 24)
+		it->u = minor;
+	else if (get_be(r, 1 << (minor - 24), &it->u))
+		return -1;
+
+	it->type = types[major];
+	if (major == 1)
+		it->u = (uint64_t)(-1 - (int64_t)it->u);
+	if (major == 2 || major == 3)
+		return get_data(r, it);
+
+	return 0;
+}
+
+static int msgpack_get_item(struct bin_reader *r, struct bin_item *it)
+{
+	uint8_t byte;
+
+	if (r->p == r->end) {
+		pr_err("Truncated input\n");
+		return -1;
+	}
+
+	byte = *r->p++;
+	it->indef = false;
+
+	if (byte < 0x80 || byte >= 0xe0) {
+		it->type = BIN_INT;
+		it->u = (uint64_t)(int64_t)(int8_t)byte;
+		return 0;
+	}
+
+	/* fixmap, fixarray and fixstr */
+	if (byte < 0xc0) {
+		it->u = byte & (byte < 0xa0 ? 0x0f : 0x1f);
+		it->type = byte < 0x90 ? BIN_MAP : byte < 0xa0 ? BIN_ARRAY : BIN_STR;
+		return it->type == BIN_STR ? get_data(r, it) : 0;
+	}
+
+	switch (byte) {
+	case 0xc0:
+		it->type = BIN_NULL;
+		return 0;
+	case 0xc2:
+	case 0xc3:
+		it->type = BIN_BOOL;
+		it->u = byte == 0xc3;
+		return 0;
+	case 0xc4: case 0xc5: case 0xc6:
+		it->type = BIN_BYTES;
+		return get_be(r, 1 << (byte - 0xc4), &it->u) ?: get_data(r, it);
+	case 0xca:
+		return get_float(r, 4, it);
+	case 0xcb:
+		return get_float(r, 8, it);
+	case 0xcc: case 0xcd: case 0xce: case 0xcf:
+		it->type = BIN_INT;
+		return get_be(r, 1 << (byte - 0xcc), &it->u);
+	case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+		{
+		int n = 1 << (byte - 0xd0);
+
+		it->type = BIN_INT;
+		if (get_be(r, n, &it->u))
+			return -1;
+		/* sign extend */
+		if (n < 8 && it->u >> (8 * n - 1))
+			it->u |= ~0ULL << (8 * n);
+		return 0;
+		}
+	case 0xd9: case 0xda: case 0xdb:
+		it->type = BIN_STR;
+		return get_be(r, 1 << (byte - 0xd9), &it->u) ?: get_data(r, it);
+	case 0xdc: case 0xdd:
+		it->type = BIN_ARRAY;
+		return get_be(r, 2 << (byte - 0xdc), &it->u);
+	case 0xde: case 0xdf:
+		it->type = BIN_MAP;
+		return get_be(r, 2 << (byte - 0xde), &it->u);
+	}
+
+	pr_err("Unsupported msgpack item %#x\n", byte);
+	return -1;
+}
+
+static int get_item(struct bin_reader *r, struct bin_item *it)
+{
+	if (r->fmt == FMT_CBOR)
+		return cbor_get_item(r, it);
+	return msgpack_get_item(r, it);
+}
+
+static int get_typed(struct bin_reader *r, struct bin_item *it, int type)
+{
+	if (get_item(r, it))
+		return -1;
+
+	if (it->type != type) {
+		pr_err("Unexpected item type %d, wanted %d\n", it->type, type);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bin_to_pb(const ProtobufCMessageDescriptor *desc, struct bin_reader *r,
+		     void **pb);
+
+static int bin_value_to_pb(const ProtobufCFieldDescriptor *fd, struct bin_reader *r,
+			   void *pb_field)
+{
+	struct bin_item it;
+
+	if (fd->type == PROTOBUF_C_TYPE_MESSAGE)
+		return bin_to_pb(fd->descriptor, r, pb_field);
+
+	if (get_item(r, &it))
+		return -1;
+
+	switch (fd->type) {
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_FIXED32:
+		{
+		uint32_t val = it.u;
+
+		if (it.type != BIN_INT)
+			goto bad;
+		memcpy(pb_field, &val, sizeof(val));
+		break;
+		}
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_FIXED64:
+		if (it.type != BIN_INT)
+			goto bad;
+		memcpy(pb_field, &it.u, sizeof(it.u));
+		break;
+	case PROTOBUF_C_TYPE_FLOAT:
+		{
+		float val = it.d;
+
+		if (it.type != BIN_FLOAT)
+			goto bad;
+		memcpy(pb_field, &val, sizeof(val));
+		break;
+		}
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (it.type != BIN_FLOAT)
+			goto bad;
+		memcpy(pb_field, &it.d, sizeof(it.d));
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		{
+		protobuf_c_boolean val = it.u;
+
+		if (it.type != BIN_BOOL)
+			goto bad;
+		memcpy(pb_field, &val, sizeof(val));
+		break;
+		}
+	case PROTOBUF_C_TYPE_ENUM:
+		{
+		const ProtobufCEnumValue *val_enum;
+		char name[256];
+		int32_t val;
+
+		if (it.type != BIN_STR || it.u >= sizeof(name))
+			goto bad;
+		memcpy(name, it.data, it.u);
+		name[it.u] = '\0';
+
+		val_enum = protobuf_c_enum_descriptor_get_value_by_name(fd->descriptor, name);
+		if (!val_enum) {
+			pr_err("Unknown enum value %s\n", name);
+			return -1;
+		}
+
+		val = val_enum->value;
+		memcpy(pb_field, &val, sizeof(val));
+		break;
+		}
+	case PROTOBUF_C_TYPE_STRING:
+		{
+		char *val;
+
+		if (it.type != BIN_STR)
+			goto bad;
+
+		val = mem_alloc(it.u + 1);
+		if (!val) {
+			pr_err("Can't allocate mem for string\n");
+			return -1;
+		}
+		memcpy(val, it.data, it.u);
+		val[it.u] = '\0';
+
+		memcpy(pb_field, &val, sizeof(val));
+		break;
+		}
+	case PROTOBUF_C_TYPE_BYTES:
+		{
+		ProtobufCBinaryData bin;
+
+		if (it.type != BIN_BYTES)
+			goto bad;
+
+		bin.len = it.u;
+		bin.data = mem_alloc(it.u ? it.u : 1);
+		if (!bin.data) {
+			pr_err("Can't allocate mem for bin\n");
+			return -1;
+		}
+		memcpy(bin.data, it.data, it.u);
+
+		memcpy(pb_field, &bin, sizeof(bin));
+		break;
+		}
+	default:
+		pr_err("Unknown field type\n");
+		return -1;
+	}
+
+	return 0;
+bad:
+	pr_err("Unexpected item type %d for field %s\n", it.type, fd->name);
+	return -1;
+}
+
+static int bin_to_pb(const ProtobufCMessageDescriptor *desc, struct bin_reader *r,
+		     void **pb)
+{
+	struct bin_item map, key;
+	char name[256];
+	uint64_t i;
+
+	*pb = NULL;
+
+	if (get_typed(r, &map, BIN_MAP))
+		return -1;
+
+	*pb = mem_alloc(desc->sizeof_message);
+	if (!*pb) {
+		pr_err("Can't allocate memory for pb\n");
+		return -1;
+	}
+
+	protobuf_c_message_init(desc, *pb);
+
+	for (i = 0; i < map.u; i++) {
+		const ProtobufCFieldDescriptor *fd;
+		void *pb_field, *pb_quant;
+
+		if (get_typed(r, &key, BIN_STR))
+			return -1;
+		if (key.u >= sizeof(name)) {
+			pr_err("Field name of %llu bytes is too long\n",
+			       (unsigned long long)key.u);
+			return -1;
+		}
+
+		memcpy(name, key.data, key.u);
+		name[key.u] = '\0';
+
+		fd = protobuf_c_message_descriptor_get_field_by_name(desc, name);
+		if (!fd) {
+			pr_err("Unknown field %s\n", name);
+			return -1;
+		}
+
+		pb_field = *pb + fd->offset;
+		pb_quant = *pb + fd->quantifier_offset;
+
+		switch (fd->label) {
+		case PROTOBUF_C_LABEL_REQUIRED:
+			if (bin_value_to_pb(fd, r, pb_field))
+				return -1;
+			break;
+		case PROTOBUF_C_LABEL_OPTIONAL:
+			if (fd->type != PROTOBUF_C_TYPE_MESSAGE &&
+			    fd->type != PROTOBUF_C_TYPE_STRING)
+				*(protobuf_c_boolean *)pb_quant = 1;
+
+			if (bin_value_to_pb(fd, r, pb_field))
+				return -1;
+			break;
+		case PROTOBUF_C_LABEL_REPEATED:
+			{
+			size_t value_size = get_size_of_pb_type(fd->type);
+			struct bin_item arr;
+			void *pb_array;
+			uint64_t j;
+
+			if (get_typed(r, &arr, BIN_ARRAY))
+				return -1;
+			if (arr.indef) {
+				pr_err("Indefinite length array in field %s\n", fd->name);
+				return -1;
+			}
+			if (!arr.u)
+				break;
+
+			/* Every element takes at least one byte of input */
+			if (arr.u > (uint64_t)(r->end - r->p) ||
+			    arr.u > SIZE_MAX / value_size) {
+				pr_err("Bad length %llu of field %s\n",
+				       (unsigned long long)arr.u, fd->name);
+				return -1;
+			}
+
+			pb_array = mem_alloc(arr.u * value_size);
+			if (!pb_array) {
+				pr_err("Can't alloc array for field %s\n", fd->name);
+				return -1;
+			}
+			memset(pb_array, 0, arr.u * value_size);
+
+			/* Set it up front, so that free_unpacked cleans up on errors */
+			memcpy(pb_field, &pb_array, sizeof(pb_array));
+			*(size_t *)pb_quant = arr.u;
+
+			for (j = 0; j < arr.u; j++)
+				if (bin_value_to_pb(fd, r, pb_array + j * value_size))
+					return -1;
+			break;
+			}
+		default:
+			pr_err("Unknown label of field %s\n", fd->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int write_pb(int fd, struct protobuf_info *pb_info, void *pb)
+{
+	int pb_size, ret = -1;
+	void *buf;
+
+	pb_size = pb_info->getpksize(pb);
+	buf = mem_alloc(pb_size);
+	if (!buf) {
+		pr_err("Can't allocate buffer for packed pb object\n");
+		return -1;
+	}
+
+	if (pb_info->pack(pb, buf) != pb_size) {
+		pr_err("Failed to pack pb object\n");
+		goto out;
+	}
+
+	if (write_all(fd, &pb_size, sizeof(pb_size)) ||
+	    write_all(fd, buf, pb_size))
+		goto out;
+
+	ret = 0;
+out:
+	mem_free(buf);
+	return ret;
+}
+
+static int bin_entry_to_img(struct bin_reader *r, struct protobuf_info *pb_info, int fd)
+{
+	void *pb;
+	int ret;
+
+	ret = bin_to_pb(pb_info->desc, r, &pb);
+	if (!ret)
+		ret = write_pb(fd, pb_info, pb);
+	if (pb)
+		pb_info->free(pb, &pb_allocator);
+
+	return ret;
+}
+
+int bin_to_img(const char *in, const char *out, int fmt)
+{
+	struct criu_image_info *info = NULL;
+	struct bin_reader r = { .fmt = fmt };
+	struct bin_item doc, key, it;
+	uint8_t *data = NULL;
+	size_t size;
+	char name[16];
+	int fd_in, fd_out = -1, ret = -1;
+	bool header_done = false, entries_done = false;
+	uint64_t i, j;
+	int tag;
+
+	tag = mem_tag("from-bin", NULL);
+
+	fd_in = img_open(in, O_RDONLY);
+	if (fd_in < 0 || read_fd_all(fd_in, (void **)&data, &size))
+		goto out;
+
+	r.p = data;
+	r.end = data + size;
+
+	fd_out = img_open(out, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd_out < 0)
+		goto out;
+
+	if (get_typed(&r, &doc, BIN_MAP))
+		goto out;
+
+	/*
+	 * Input document is read whole, but entries are written out as they
+	 * are decoded, so only one of them is unpacked at a time
+	 */
+	for (i = 0; i < doc.u; i++) {
+		if (get_typed(&r, &key, BIN_STR))
+			goto out;
+		if (key.u >= sizeof(name)) {
+			pr_err("Key of %llu bytes is too long\n",
+			       (unsigned long long)key.u);
+			goto out;
+		}
+
+		memcpy(name, key.data, key.u);
+		name[key.u] = '\0';
+
+		if (!strcmp(name, "magic")) {
+			uint32_t magic;
+
+			if (get_typed(&r, &it, BIN_INT))
+				goto out;
+
+			magic = it.u;
+			info = find_img_info(magic);
+			if (!info) {
+				pr_err("Unknown magic\n");
+				goto out;
+			}
+
+			if (write_all(fd_out, &magic, sizeof(magic)))
+				goto out;
+			continue;
+		}
+
+		if (!strcmp(name, "version")) {
+			if (get_typed(&r, &it, BIN_INT))
+				goto out;
+			/* Binary documents only ever had the v2 layout */
+			if (it.u != IMG_JSON_VERSION) {
+				pr_err("Unsupported version %lld\n", (long long)it.u);
+				goto out;
+			}
+			continue;
+		}
+
+		if (!info) {
+			pr_err("No magic before %s\n", name);
+			goto out;
+		}
+
+		if (!strcmp(name, "header") && !header_done) {
+			/* header goes first in the image */
+			if (entries_done) {
+				pr_err("Header after entries\n");
+				goto out;
+			}
+			if (bin_entry_to_img(&r, &info->header_info, fd_out))
+				goto out;
+			header_done = true;
+		} else if (!strcmp(name, "entries") && info->is_array && !entries_done) {
+			if (get_typed(&r, &it, BIN_ARRAY))
+				goto out;
+			entries_done = true;
+
+			for (j = 0; it.indef || j < it.u; j++) {
+				struct protobuf_info *pb_info = &info->extra_info;
+
+				if (it.indef && r.p < r.end && *r.p == 0xff) {
+					r.p++;
+					break;
+				}
+
+				if (!header_done && img_has_header(info)) {
+					pr_err("Entries before header\n");
+					goto out;
+				}
+
+				/* images without header keep their first message in entries */
+				if (j == 0 && !header_done && !img_has_header(info))
+					pb_info = &info->header_info;
+
+				if (bin_entry_to_img(&r, pb_info, fd_out)) {
+					pr_err("Can't convert entry #%llu\n",
+					       (unsigned long long)j);
+					goto out;
+				}
+			}
+		} else {
+			pr_err("Unexpected key %s\n", name);
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	mem_free(data);
+	if (fd_out >= 0)
+		close(fd_out);
+	if (fd_in >= 0)
+		close(fd_in);
+	mem_untag(tag);
+	return ret;
+}
@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crc32c.h"
+
+static uint32_t crc32c_table[256];
+
+void crc32c_init(void)
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+uint32_t crc32c(const void *data, size_t len)
+{
+	return crc32c_update(0, data, len);
+}
@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "log.h"
+#include "protobuf2json.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "pool.h"
+#include "csv.h"
+
+/*
+ * to-csv flattens every entry of one message type into a csv row.
+ * Columns are derived from the message descriptor, nested messages
+ * are flattened into "parent.child" columns, repeated scalars are
+ * joined with ';' in one cell. Rows from all the images found in
+ * SRC (image or dump directory) are appended to the same DEST file.
+ *
+ * Images are converted in parallel, a batch of them at a time, each into
+ * its own buffer. Buffers are appended in image order, so DEST doesn't
+ * depend on the number of workers.
+ */
+
+#define CSV_MAX_DEPTH	8
+#define CSV_MAX_COLUMNS	512
+#define CSV_BUF_SIZE	(1 << 20)
+
+struct csv_column {
+	char				name[256];
+	int				depth;
+	const ProtobufCFieldDescriptor	*fds[CSV_MAX_DEPTH];
+};
+
+struct csv_img {
+	const char	*path;
+	char		*rows;
+	size_t		len;
+	unsigned long	nr_rows;
+	int		ret;
+};
+
+struct csv {
+	const ProtobufCMessageDescriptor	*desc;
+	struct csv_column			columns[CSV_MAX_COLUMNS];
+	int					nr_columns;
+	FILE					*f;
+	unsigned long				nr_rows;
+	bool					skip_unknown;
+	struct csv_img				*imgs;
+};
+
+static int add_columns(struct csv *csv, const ProtobufCMessageDescriptor *desc,
+		       struct csv_column *parent)
+{
+	int i;
+
+	for (i = 0; i < desc->n_fields; i++) {
+		const ProtobufCFieldDescriptor *fd = desc->fields + i;
+		struct csv_column col = {};
+
+		if (parent) {
+			col = *parent;
+			snprintf(col.name, sizeof(col.name), "%s.%s", parent->name, fd->name);
+		} else
+			snprintf(col.name, sizeof(col.name), "%s", fd->name);
+
+		col.fds[col.depth++] = fd;
+
+		if (fd->type == PROTOBUF_C_TYPE_MESSAGE &&
+		    fd->label != PROTOBUF_C_LABEL_REPEATED &&
+		    col.depth < CSV_MAX_DEPTH) {
+			if (add_columns(csv, fd->descriptor, &col))
+				return -1;
+			continue;
+		}
+
+		if (fd->type == PROTOBUF_C_TYPE_MESSAGE) {
+			if (fd->label == PROTOBUF_C_LABEL_REPEATED)
+				pr_info("Skipping repeated message field %s\n", col.name);
+			else
+				pr_info("Skipping field %s nested deeper than %d levels\n",
+					col.name, CSV_MAX_DEPTH);
+			continue;
+		}
+
+		if (csv->nr_columns == CSV_MAX_COLUMNS) {
+			pr_err("Too many columns in %s\n", csv->desc->name);
+			return -1;
+		}
+
+		csv->columns[csv->nr_columns++] = col;
+	}
+
+	return 0;
+}
+
+static void csv_put_escaped(FILE *f, const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '"')
+			putc('"', f);
+		putc(*str, f);
+	}
+}
+
+static void csv_put_string(FILE *f, const char *str)
+{
+	putc('"', f);
+	csv_put_escaped(f, str);
+	putc('"', f);
+}
+
+static void csv_put_value(FILE *f, const ProtobufCFieldDescriptor *fd, const void *val)
+{
+	switch (fd->type) {
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+		fprintf(f, "%d", *(int32_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_FIXED32:
+		fprintf(f, "%u", *(uint32_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+		fprintf(f, "%lld", (long long)*(int64_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_FIXED64:
+		fprintf(f, "%llu", (unsigned long long)*(uint64_t *)val);
+		break;
+	case PROTOBUF_C_TYPE_FLOAT:
+		fprintf(f, "%.9g", *(float *)val);
+		break;
+	case PROTOBUF_C_TYPE_DOUBLE:
+		fprintf(f, "%.17g", *(double *)val);
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		fputs(*(protobuf_c_boolean *)val ? "true" : "false", f);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+		{
+		const ProtobufCEnumValue *pb_enum_val;
+
+		pb_enum_val = protobuf_c_enum_descriptor_get_value(fd->descriptor, *(int *)val);
+		if (pb_enum_val)
+			fputs(pb_enum_val->name, f);
+		else
+			fprintf(f, "%d", *(int *)val);
+		break;
+		}
+	case PROTOBUF_C_TYPE_STRING:
+		csv_put_string(f, *(char **)val);
+		break;
+	case PROTOBUF_C_TYPE_BYTES:
+		{
+		const ProtobufCBinaryData *pb_bin = val;
+		size_t i;
+
+		for (i = 0; i < pb_bin->len; i++)
+			fprintf(f, "%02x", pb_bin->data[i]);
+		break;
+		}
+	default:
+		break;
+	}
+}
+
+static void csv_put_column(FILE *f, struct csv_column *col, const void *pb)
+{
+	const ProtobufCFieldDescriptor *fd;
+	const void *pb_field;
+	int d;
+
+	for (d = 0; d < col->depth - 1; d++) {
+		fd = col->fds[d];
+		if (!pb_field_present(fd, pb))
+			return;
+		pb = *(const void * const *)(pb + fd->offset);
+	}
+
+	fd = col->fds[d];
+	if (!pb_field_present(fd, pb))
+		return;
+
+	pb_field = pb + fd->offset;
+
+	if (fd->label == PROTOBUF_C_LABEL_REPEATED) {
+		size_t i, n = *(const size_t *)(pb + fd->quantifier_offset);
+		size_t size = get_size_of_pb_type(fd->type);
+		const void *arr = *(const void * const *)pb_field;
+
+		putc('"', f);
+		for (i = 0; i < n; i++) {
+			if (i)
+				putc(';', f);
+			if (fd->type == PROTOBUF_C_TYPE_STRING)
+				csv_put_escaped(f, *(char **)(arr + i * size));
+			else
+				csv_put_value(f, fd, arr + i * size);
+		}
+		putc('"', f);
+	} else
+		csv_put_value(f, fd, pb_field);
+}
+
+static void csv_put_row(struct csv *csv, FILE *f, const char *img, const void *pb)
+{
+	int i;
+
+	csv_put_string(f, img);
+	for (i = 0; i < csv->nr_columns; i++) {
+		putc(',', f);
+		csv_put_column(f, &csv->columns[i], pb);
+	}
+	putc('\n', f);
+}
+
+/* Converts image #idx into rows of csv->imgs[idx] */
+static int img_append_csv(void *arg, int idx)
+{
+	struct csv *csv = arg;
+	struct csv_img *img = &csv->imgs[idx];
+	const char *path = img->path;
+	struct criu_image_info *info;
+	FILE *f = NULL;
+	uint32_t magic;
+	int fd, i, ret = -1;
+	const char *name;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open %s", path);
+		img->ret = -1;
+		return -1;
+	}
+
+	if (read(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_perror("Can't read magic from %s", path);
+		goto out;
+	}
+
+	info = find_img_info(magic);
+	if (!info && csv->skip_unknown) {
+		pr_info("Skipping %s with unknown magic\n", path);
+		ret = 0;
+		goto out;
+	} else if (!info) {
+		pr_err("Unknown magic in %s\n", path);
+		goto out;
+	}
+
+	/* Skip images that can't contain our message at all */
+	if (info->header_info.desc != csv->desc &&
+	    (!info->is_array || info->extra_info.desc != csv->desc)) {
+		ret = 0;
+		goto out;
+	}
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	f = open_memstream(&img->rows, &img->len);
+	if (!f) {
+		pr_perror("Can't allocate rows of %s", path);
+		goto out;
+	}
+
+	for (i = 0; ; i++) {
+		struct protobuf_info *pb_info;
+		void *obj;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (info->is_array)
+			pb_info = &info->extra_info;
+		else
+			break;
+
+		ret = read_pb(fd, &obj, pb_info);
+		if (ret < 0)
+			goto out;
+		else if (ret == 0)
+			break;
+
+		if (pb_info->desc == csv->desc) {
+			csv_put_row(csv, f, name, obj);
+			img->nr_rows++;
+		}
+
+		pb_info->free(obj, &pb_allocator);
+	}
+
+	ret = 0;
+out:
+	if (f && fclose(f)) {
+		pr_perror("Can't write rows of %s", path);
+		ret = -1;
+	}
+	close(fd);
+	img->ret = ret;
+	return ret;
+}
+
+static void csv_img_reset(struct csv_img *img)
+{
+	free(img->rows);
+	memset(img, 0, sizeof(*img));
+}
+
+static void csv_put_header(struct csv *csv, FILE *f)
+{
+	int i;
+
+	fputs("image", f);
+	for (i = 0; i < csv->nr_columns; i++)
+		fprintf(f, ",%s", csv->columns[i].name);
+	putc('\n', f);
+}
+
+/* Rows are appended only under the header of the same message */
+static int csv_check_header(struct csv *csv, const char *out)
+{
+	char *line = NULL, *header = NULL;
+	size_t len = 0, header_len = 0;
+	FILE *f, *mf;
+	int ret = -1;
+
+	f = fopen(out, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		pr_perror("Can't open %s", out);
+		return -1;
+	}
+
+	if (getline(&line, &len, f) < 0) {
+		ret = 0;
+		goto out;
+	}
+
+	mf = open_memstream(&header, &header_len);
+	if (!mf) {
+		pr_perror("Can't build csv header");
+		goto out;
+	}
+	csv_put_header(csv, mf);
+	if (fclose(mf)) {
+		pr_perror("Can't build csv header");
+		goto out;
+	}
+
+	if (strcmp(line, header))
+		pr_err("%s has columns of another message than %s\n",
+		       out, csv->desc->name);
+	else
+		ret = 0;
+out:
+	free(header);
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+int img_to_csv(char msg[], char src[], char out[])
+{
+	struct csv *csv;
+	struct stat st;
+	char *buf = NULL, **paths;
+	int i, j, nr, nr_paths, ret = -1;
+
+	csv = mem_calloc(1, sizeof(*csv));
+	if (!csv) {
+		pr_err("Can't allocate csv\n");
+		return -1;
+	}
+
+	csv->desc = find_msg_desc(msg);
+	if (!csv->desc) {
+		pr_err("Unknown message %s\n", msg);
+		goto out;
+	}
+
+	if (add_columns(csv, csv->desc, NULL))
+		goto out;
+
+	/* Appending to an existing file, header is already there */
+	if (csv_check_header(csv, out))
+		goto out;
+
+	csv->f = fopen(out, "a");
+	if (!csv->f) {
+		pr_perror("Can't open %s", out);
+		goto out;
+	}
+
+	buf = mem_alloc(CSV_BUF_SIZE);
+	if (buf)
+		setvbuf(csv->f, buf, _IOFBF, CSV_BUF_SIZE);
+
+	if (fstat(fileno(csv->f), &st) == 0 && st.st_size == 0)
+		csv_put_header(csv, csv->f);
+
+	nr_paths = img_list(src, &paths);
+	if (nr_paths < 0)
+		goto out;
+
+	csv->skip_unknown = img_is_dir(src);
+
+	nr = nr_workers();
+	csv->imgs = mem_calloc(nr, sizeof(*csv->imgs));
+	if (!csv->imgs) {
+		pr_err("Can't allocate csv images\n");
+		img_list_free(paths, nr_paths);
+		goto out;
+	}
+
+	ret = 0;
+	for (i = 0; i < nr_paths && !ret; i += nr) {
+		int nr_batch = nr_paths - i < nr ? nr_paths - i : nr;
+
+		for (j = 0; j < nr_batch; j++)
+			csv->imgs[j].path = paths[i + j];
+
+		ret = run_parallel(nr_batch, img_append_csv, csv);
+
+		/* Rows of images before a failed one are kept, as if done in turn */
+		for (j = 0; j < nr_batch && !csv->imgs[j].ret; j++) {
+			struct csv_img *img = &csv->imgs[j];
+
+			if (img->len)
+				fwrite(img->rows, 1, img->len, csv->f);
+			csv->nr_rows += img->nr_rows;
+		}
+
+		for (j = 0; j < nr_batch; j++)
+			csv_img_reset(&csv->imgs[j]);
+	}
+
+	img_list_free(paths, nr_paths);
+
+	pr_info("Appended %lu %s rows to %s\n", csv->nr_rows, msg, out);
+out:
+	if (csv->f && fclose(csv->f)) {
+		pr_perror("Can't write %s", out);
+		ret = -1;
+	}
+	mem_free(buf);
+	mem_free(csv->imgs);
+	mem_free(csv);
+	return ret;
+}
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "pool.h"
+#include "crc32c.h"
+#include "fsck.h"
+
+/*
+ * fsck checks every image of SRC: magic, chain of size prefixes,
+ * that every entry unpacks (which also checks required fields) and that
+ * single message images hold exactly one message. Checking stops on the
+ * first bad entry.
+ *
+ * With SUMS file given, per-entry crc32c checksums of good images are
+ * written to it. When SUMS already exists, images listed there are only
+ * checked against the checksums, without decoding, and every image listed
+ * there has to be present.
+ *
+ * Images with unknown magic (tmpfs tarballs, route and iptables dumps)
+ * are skipped when checking a directory.
+ *
+ * SUMS has one line per image: "NAME FILE_SIZE NR_ENTRIES CRC CRC ..."
+ */
+
+#define SUMS_HEADER	"# criu2json fsck sums v1"
+
+struct fsck_sums {
+	char		*name;
+	off_t		size;
+	int		nr;
+	uint32_t	*crcs;
+	bool		found;
+};
+
+struct fsck_img {
+	char		*path;
+	struct fsck_sums *expected;
+	struct fsck_sums sums;
+	bool		skipped;
+};
+
+struct fsck {
+	struct fsck_img		*imgs;
+	bool			write_sums;
+	bool			skip_unknown;
+	/* set by the first worker that fails, checked by all of them */
+	volatile sig_atomic_t	stop;
+};
+
+static const char *img_name(const char *path)
+{
+	const char *name = strrchr(path, '/');
+
+	return name ? name + 1 : path;
+}
+
+static int add_crc(struct fsck_sums *sums, uint32_t crc)
+{
+	if ((sums->nr & (sums->nr - 1)) == 0) {
+		uint32_t *crcs;
+
+		crcs = mem_realloc(sums->crcs, (sums->nr ? sums->nr * 2 : 1) * sizeof(*crcs));
+		if (!crcs) {
+			pr_err("Can't allocate checksums\n");
+			return -1;
+		}
+		sums->crcs = crcs;
+	}
+
+	sums->crcs[sums->nr++] = crc;
+	return 0;
+}
+
+/* Walk size prefixes, decoding entries unless only checksums are checked */
+static int fsck_entries(struct fsck *f, struct fsck_img *img, const uint8_t *map,
+			off_t size, struct criu_image_info *info)
+{
+	struct fsck_sums *exp = img->expected;
+	const char *path = img->path;
+	off_t off = sizeof(uint32_t);
+	int i;
+
+	for (i = 0; off < size; i++) {
+		struct protobuf_info *pb_info;
+		uint32_t crc;
+		int pb_size;
+
+		if (f->stop)
+			return -1;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (info->is_array)
+			pb_info = &info->extra_info;
+		else {
+			pr_err("%s: trailing data after the only entry at offset %lld\n",
+			       path, (long long)off);
+			return -1;
+		}
+
+		if (size - off < sizeof(pb_size)) {
+			pr_err("%s: truncated size of entry #%d at offset %lld\n",
+			       path, i, (long long)off);
+			return -1;
+		}
+
+		memcpy(&pb_size, map + off, sizeof(pb_size));
+		if (pb_size < 0 || pb_size > size - off - sizeof(pb_size)) {
+			pr_err("%s: entry #%d at offset %lld has bad size %d\n",
+			       path, i, (long long)off, pb_size);
+			return -1;
+		}
+
+		crc = crc32c(map + off + sizeof(pb_size), pb_size);
+
+		if (exp) {
+			if (i >= exp->nr || exp->crcs[i] != crc) {
+				pr_err("%s: entry #%d at offset %lld doesn't match checksum\n",
+				       path, i, (long long)off);
+				return -1;
+			}
+		} else {
+			void *obj;
+
+			obj = pb_info->unpack(&pb_allocator, pb_size,
+					      (void *)(map + off + sizeof(pb_size)));
+			if (!obj) {
+				pr_err("%s: can't decode entry #%d at offset %lld\n",
+				       path, i, (long long)off);
+				return -1;
+			}
+			pb_info->free(obj, &pb_allocator);
+		}
+
+		if (f->write_sums && add_crc(&img->sums, crc))
+			return -1;
+
+		off += sizeof(pb_size) + pb_size;
+	}
+
+	if (exp && i != exp->nr) {
+		pr_err("%s: %d entries instead of %d\n", path, i, exp->nr);
+		return -1;
+	}
+
+	if (i == 0 && !info->is_array) {
+		pr_err("%s: no entry\n", path);
+		return -1;
+	}
+
+	pr_info("%s: %d entries OK\n", path, i);
+	return 0;
+}
+
+static int fsck_img(void *arg, int idx)
+{
+	struct fsck *f = arg;
+	struct fsck_img *img = &f->imgs[idx];
+	struct criu_image_info *info;
+	const uint8_t *map = NULL;
+	struct stat st;
+	uint32_t magic;
+	int fd, ret = -1;
+
+	if (f->stop)
+		return -1;
+
+	fd = open(img->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		pr_perror("Can't open %s", img->path);
+		goto out;
+	}
+
+	if (img->expected && img->expected->size != st.st_size) {
+		pr_err("%s: size %lld instead of %lld\n", img->path,
+		       (long long)st.st_size, (long long)img->expected->size);
+		goto out;
+	}
+
+	if (st.st_size < sizeof(magic)) {
+		pr_err("%s: no magic\n", img->path);
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		pr_perror("Can't map %s", img->path);
+		map = NULL;
+		goto out;
+	}
+
+	memcpy(&magic, map, sizeof(magic));
+	info = find_img_info(magic);
+	if (!info && f->skip_unknown && !img->expected) {
+		pr_info("Skipping %s with unknown magic\n", img->path);
+		img->skipped = true;
+		ret = 0;
+		goto out;
+	} else if (!info) {
+		pr_err("%s: unknown magic %#x at offset 0\n", img->path, magic);
+		goto out;
+	}
+
+	img->sums.size = st.st_size;
+	ret = fsck_entries(f, img, map, st.st_size, info);
+out:
+	if (map)
+		munmap((void *)map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	if (ret)
+		f->stop = 1;
+	return ret;
+}
+
+static int read_sums(const char *path, struct fsck_sums **sums, int *nr)
+{
+	char *line = NULL, *p, *end;
+	size_t len = 0;
+	FILE *f;
+	int ret = -1;
+
+	*sums = NULL;
+	*nr = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -1;
+
+	while (getline(&line, &len, f) > 0) {
+		struct fsck_sums *s;
+		char name[256];
+		long long size;
+		int i, n, pos;
+
+		if (line[0] == '#')
+			continue;
+
+		if (sscanf(line, "%255s %lld %d%n", name, &size, &n, &pos) != 3 || n < 0) {
+			pr_err("Bad line in %s: %s", path, line);
+			goto out;
+		}
+
+		s = mem_realloc(*sums, (*nr + 1) * sizeof(**sums));
+		if (!s)
+			goto out;
+		*sums = s;
+		s = &s[(*nr)++];
+
+		s->name = mem_strdup(name);
+		s->size = size;
+		s->nr = n;
+		s->crcs = mem_calloc(n ? n : 1, sizeof(uint32_t));
+		if (!s->name || !s->crcs)
+			goto out;
+
+		for (i = 0, p = line + pos; i < n; i++, p = end) {
+			s->crcs[i] = strtoul(p, &end, 16);
+			if (end == p) {
+				pr_err("Bad checksums for %s in %s\n", name, path);
+				goto out;
+			}
+		}
+	}
+
+	ret = 0;
+out:
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static int write_sums(const char *path, struct fsck_img *imgs, int n)
+{
+	FILE *f;
+	int i, j;
+
+	f = fopen(path, "w");
+	if (!f) {
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	fprintf(f, "%s\n", SUMS_HEADER);
+	for (i = 0; i < n; i++) {
+		if (imgs[i].skipped)
+			continue;
+
+		fprintf(f, "%s %lld %d", img_name(imgs[i].path),
+			(long long)imgs[i].sums.size, imgs[i].sums.nr);
+		for (j = 0; j < imgs[i].sums.nr; j++)
+			fprintf(f, " %08x", imgs[i].sums.crcs[j]);
+		fputc('\n', f);
+	}
+
+	if (fclose(f)) {
+		pr_perror("Can't write %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int fsck_imgs(char src[], char sums[])
+{
+	struct fsck f = {};
+	struct fsck_sums *exp = NULL;
+	char **paths = NULL;
+	int n, nr_exp = 0, i, j, ret = -1;
+
+	crc32c_init();
+
+	if (sums && read_sums(sums, &exp, &nr_exp)) {
+		pr_err("Can't read checksums from %s\n", sums);
+		goto out;
+	}
+
+	/* New sums are written only if there were none yet */
+	f.write_sums = sums && !exp;
+
+	n = img_list(src, &paths);
+	if (n < 0)
+		goto out;
+
+	f.imgs = mem_calloc(n ? n : 1, sizeof(*f.imgs));
+	if (!f.imgs) {
+		pr_err("Can't allocate images\n");
+		goto out_list;
+	}
+
+	f.skip_unknown = img_is_dir(src);
+
+	for (i = 0; i < n; i++) {
+		f.imgs[i].path = paths[i];
+		for (j = 0; j < nr_exp; j++)
+			if (!strcmp(exp[j].name, img_name(paths[i]))) {
+				f.imgs[i].expected = &exp[j];
+				exp[j].found = true;
+			}
+	}
+
+	ret = run_parallel(n, fsck_img, &f);
+
+	/* A deleted image must not pass just because nothing checked it */
+	for (j = 0; j < nr_exp; j++) {
+		if (!exp[j].found) {
+			pr_err("%s is listed in %s but missing\n", exp[j].name, sums);
+			ret = -1;
+		}
+	}
+	if (!ret && f.write_sums)
+		ret = write_sums(sums, f.imgs, n);
+
+	for (i = 0; i < n; i++)
+		mem_free(f.imgs[i].sums.crcs);
+	mem_free(f.imgs);
+out_list:
+	img_list_free(paths, n);
+out:
+	for (j = 0; j < nr_exp; j++) {
+		mem_free(exp[j].name);
+		mem_free(exp[j].crcs);
+	}
+	mem_free(exp);
+	return ret;
+}
@@ -0,0 +1,950 @@
+#define _GNU_SOURCE
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "protobuf2json.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "intern.h"
+#include "shard.h"
+
+struct criu_image_info img_infos [] = {
+	SINGLE( INVENTORY,	inventory_entry 	),
+	SINGLE( CORE,		core_entry		),
+	SINGLE( IDS,		task_kobj_ids_entry	),
+	SINGLE( CREDS,		creds_entry		),
+	SINGLE( UTSNS,		utsns_entry		),
+	SINGLE( IPC_VAR,	ipc_var_entry		),
+	SINGLE( FS,		fs_entry		),
+	SINGLE( GHOST_FILE,	ghost_file_entry	),
+	SINGLE( MM,		mm_entry		),
+	SINGLE( CGROUP,		cgroup_entry		),
+	SINGLE( TCP_STREAM,	tcp_stream_entry	),
+	SINGLE( STATS,		stats_entry		),
+
+	ARRAY( PSTREE,		pstree_entry		),
+	ARRAY( REG_FILES,	reg_file_entry		),
+	ARRAY( NS_FILES,	ns_file_entry		),
+	ARRAY( EVENTFD_FILE,	eventfd_file_entry	),
+	ARRAY( EVENTPOLL_FILE,	eventpoll_file_entry	),
+	ARRAY( EVENTPOLL_TFD,	eventpoll_tfd_entry	),
+	ARRAY( SIGNALFD,	signalfd_entry		),
+	ARRAY( TIMERFD,		timerfd_entry		),
+	ARRAY( INOTIFY_FILE,	inotify_file_entry	),
+	ARRAY( INOTIFY_WD,	inotify_wd_entry	),
+	ARRAY( FANOTIFY_FILE,	fanotify_file_entry	),
+	ARRAY( FANOTIFY_MARK,	fanotify_mark_entry	),
+	ARRAY( VMAS,		vma_entry		),
+	ARRAY( PIPES,		pipe_entry		),
+	ARRAY( FIFO,		fifo_entry		),
+	ARRAY( SIGACT,		sa_entry		),
+	ARRAY( NETLINK_SK,	netlink_sk_entry	),
+	ARRAY( REMAP_FPATH,	remap_file_path_entry	),
+	ARRAY( MNTS,		mnt_entry		),
+	ARRAY( TTY_FILES,	tty_file_entry		),
+	ARRAY( TTY_INFO,	tty_info_entry		),
+	ARRAY( RLIMIT,		rlimit_entry		),
+	ARRAY( TUNFILE,		tunfile_entry		),
+	ARRAY( EXT_FILES,	ext_file_entry		),
+	ARRAY( IRMAP_CACHE,	irmap_cache_entry	),
+	ARRAY( FILE_LOCKS,	file_lock_entry		),
+	ARRAY( FDINFO,		fdinfo_entry		),
+	ARRAY( UNIXSK,		unix_sk_entry		),
+	ARRAY( INETSK,		inet_sk_entry		),
+	ARRAY( PACKETSK,	packet_sock_entry	),
+	ARRAY( ITIMERS,		itimer_entry		),
+	ARRAY( POSIX_TIMERS,	posix_timer_entry	),
+	ARRAY( NETDEV,		net_device_entry	),
+	ARRAY( PIPES_DATA,	pipe_data_entry		),
+	ARRAY( FIFO_DATA,	pipe_data_entry		),
+	ARRAY( SK_QUEUES,	sk_packet_entry		),
+	ARRAY( IPCNS_SHM,	ipc_shm_entry		),
+	ARRAY( IPCNS_SEM,	ipc_sem_entry		),
+	ARRAY( IPCNS_MSG,	ipc_msg_entry		),
+
+	/*
+	 * This one is the special one. It has header pagemap_head
+	 * that is followed by an array of pagemap_entry msgs
+	 */
+	{ PAGEMAP_MAGIC, true, PB_INFO(pagemap_head), PB_INFO(pagemap_entry) },
+
+	{}
+};
+
+struct criu_image_info *find_img_info(uint32_t magic)
+{
+	int i;
+
+	for (i = 0; img_infos[i].magic; i++)
+		if (img_infos[i].magic == magic)
+			return &img_infos[i];
+
+	return NULL;
+}
+
+const ProtobufCMessageDescriptor *find_msg_desc(const char *msg)
+{
+	int i;
+
+	for (i = 0; img_infos[i].magic; i++) {
+		struct criu_image_info *info = &img_infos[i];
+
+		if (!strcmp(info->header_info.desc->name, msg))
+			return info->header_info.desc;
+		if (info->is_array && !strcmp(info->extra_info.desc->name, msg))
+			return info->extra_info.desc;
+	}
+
+	return NULL;
+}
+
+int img_open(const char *path, int flags)
+{
+	char *end;
+	int fd;
+
+	if (!strcmp(path, "-"))
+		fd = dup((flags & O_ACCMODE) == O_RDONLY ? STDIN_FILENO : STDOUT_FILENO);
+	else if (!strncmp(path, "fd:", 3)) {
+		fd = strtol(path + 3, &end, 10);
+		if (end == path + 3 || *end != '\0' || fd < 0) {
+			pr_err("Bad descriptor %s\n", path);
+			return -1;
+		}
+		fd = dup(fd);
+	} else
+		fd = open(path, flags, 0600);
+
+	if (fd < 0)
+		pr_perror("Can't open %s", path);
+
+	return fd;
+}
+
+FILE *img_fopen(const char *path, const char *mode)
+{
+	FILE *f;
+	int fd;
+
+	fd = img_open(path, mode[0] == 'r' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd < 0)
+		return NULL;
+
+	f = fdopen(fd, mode);
+	if (!f) {
+		pr_perror("Can't open %s", path);
+		close(fd);
+	}
+
+	return f;
+}
+
+ssize_t read_all(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = read(fd, buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_perror("Can't write output");
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int read_fd_all(int fd, void **buf, size_t *size)
+{
+	size_t alloc = 1 << 16;
+	struct stat st;
+	void *data;
+	ssize_t ret;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size >= alloc)
+		alloc = st.st_size + 1;
+
+	*size = 0;
+	*buf = mem_alloc(alloc);
+	if (!*buf)
+		goto err;
+
+	while ((ret = read_all(fd, *buf + *size, alloc - *size)) > 0) {
+		*size += ret;
+		if (*size < alloc)
+			break;
+
+		data = mem_realloc(*buf, alloc * 2);
+		if (!data)
+			goto err;
+		*buf = data;
+		alloc *= 2;
+	}
+
+	if (ret < 0) {
+		pr_perror("Can't read input");
+		goto err;
+	}
+
+	return 0;
+err:
+	pr_err("Can't read input\n");
+	mem_free(*buf);
+	*buf = NULL;
+	return -1;
+}
+
+#define SPLICE_CHUNK	(1 << 20)
+
+static int copy_fd(int fd_in, int fd_out, long long len)
+{
+	char buf[1 << 16];
+	ssize_t ret;
+
+	while (len != 0) {
+		size_t chunk = len < 0 || len > sizeof(buf) ? sizeof(buf) : len;
+
+		ret = read_all(fd_in, buf, chunk);
+		if (ret < 0) {
+			pr_perror("Can't read input");
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		if (write_all(fd_out, buf, ret))
+			return -1;
+		if (len > 0)
+			len -= ret;
+	}
+
+	if (len > 0) {
+		pr_err("Unexpected end of input\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int img_splice(int fd_in, int fd_out, long long len)
+{
+	ssize_t ret;
+
+	while (len != 0) {
+		size_t chunk = len < 0 || len > SPLICE_CHUNK ? SPLICE_CHUNK : len;
+
+		ret = splice(fd_in, NULL, fd_out, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* Neither end is a pipe, or the output can't take spliced data */
+		if (ret < 0 && (errno == EINVAL || errno == ESPIPE))
+			return copy_fd(fd_in, fd_out, len);
+		if (ret < 0) {
+			pr_perror("Can't splice entries");
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		if (len > 0)
+			len -= ret;
+	}
+
+	if (len > 0) {
+		pr_err("Unexpected end of input\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int read_pb_buf(int fd, void **buf, int *size)
+{
+	ssize_t ret;
+
+	*buf = NULL;
+
+	ret = read_all(fd, size, sizeof(*size));
+	if (ret == 0)
+		return 0;
+	else if (ret != sizeof(*size)) {
+		pr_err("Can't read size of protobuf message\n");
+		return -1;
+	}
+
+	if (*size < 0) {
+		pr_err("Corrupt image, message size %d\n", *size);
+		return -1;
+	}
+
+	*buf = mem_alloc(*size);
+	if (!*buf) {
+		pr_err("Can't allocate mem for pb message\n");
+		return -1;
+	}
+
+	if (read_all(fd, *buf, *size) != *size) {
+		pr_err("Can't read pb message\n");
+		mem_free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+int read_pb(int fd, void **pb, struct protobuf_info *info)
+{
+	int size, ret, tag;
+	void *buf = NULL;
+
+	tag = mem_tag("read", info->desc->name);
+	ret = read_pb_buf(fd, &buf, &size);
+	if (ret <= 0)
+		goto out;
+
+	mem_tag("unpack", info->desc->name);
+	*pb = info->unpack(&pb_allocator, size, buf);
+	if (*pb == NULL) {
+		pr_err("Can't unpack pb message\n");
+		ret = -1;
+	}
+
+	mem_free(buf);
+out:
+	mem_untag(tag);
+	return ret;
+}
+
+bool img_name_listed(const char *name)
+{
+	size_t len = strlen(name);
+
+	/* pages-*.img hold raw memory contents, not protobuf messages */
+	if (!strncmp(name, "pages-", 6))
+		return false;
+
+	return len > 4 && !strcmp(name + len - 4, ".img");
+}
+
+static int img_filter(const struct dirent *d)
+{
+	return img_name_listed(d->d_name);
+}
+
+int img_list(const char *src, char ***paths)
+{
+	struct dirent **names;
+	struct stat st;
+	int n, i;
+
+	if (stat(src, &st)) {
+		pr_perror("Can't stat %s", src);
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		*paths = malloc(sizeof(char *));
+		if (!*paths || !((*paths)[0] = strdup(src))) {
+			pr_err("Can't allocate image list\n");
+			free(*paths);
+			return -1;
+		}
+		return 1;
+	}
+
+	n = scandir(src, &names, img_filter, alphasort);
+	if (n < 0) {
+		pr_perror("Can't scan %s", src);
+		return -1;
+	}
+
+	*paths = calloc(n ? n : 1, sizeof(char *));
+	for (i = 0; i < n; i++) {
+		if (*paths && asprintf(&(*paths)[i], "%s/%s", src, names[i]->d_name) < 0) {
+			(*paths)[i] = NULL;
+			img_list_free(*paths, n);
+			*paths = NULL;
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	if (!*paths) {
+		pr_err("Can't allocate image list\n");
+		return -1;
+	}
+
+	return n;
+}
+
+bool img_is_dir(const char *src)
+{
+	struct stat st;
+
+	return !stat(src, &st) && S_ISDIR(st.st_mode);
+}
+
+void img_list_free(char **paths, int n)
+{
+	int i;
+
+	for (i = 0; paths && i < n; i++)
+		free(paths[i]);
+	free(paths);
+}
+
+/*
+ * Only images whose first message differs from the rest (pagemap) or
+ * that have a single message at all keep it under "header".
+ */
+bool img_has_header(struct criu_image_info *info)
+{
+	return !info->is_array || info->header_info.desc != info->extra_info.desc;
+}
+
+json_t *img_json_entry(json_t *js, int i)
+{
+	json_t *js_header, *js_entries;
+	char name[16];
+
+	js_entries = json_object_get(js, "entries");
+	js_header = json_object_get(js, "header");
+
+	if (js_header || js_entries) {
+		if (js_header) {
+			if (i == 0)
+				return js_header;
+			i--;
+		}
+
+		return json_array_get(js_entries, i);
+	}
+
+	/* v1 layout with "0", "1", ... keys */
+	snprintf(name, sizeof(name), "%d", i);
+
+	return json_object_get(js, name);
+}
+
+static struct criu_image_info *img_read_info(int fd)
+{
+	struct criu_image_info *info;
+	uint32_t magic;
+
+	if (read_all(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_perror("Can't read magic from input file");
+		return NULL;
+	}
+
+	info = find_img_info(magic);
+	if (!info)
+		pr_err("Unknown magic");
+
+	return info;
+}
+
+/* cb gets a new reference to every entry and has to consume it */
+typedef int (*img_entry_cb_t)(void *data, int i, json_t *js_entry);
+
+static int img_for_each_json(int fd, struct criu_image_info *info,
+			     img_entry_cb_t cb, void *data)
+{
+	int ret, i;
+
+	for (i = 0; ; i++) {
+		void *obj;
+		struct protobuf_info *pb_info = NULL;
+		json_t *js_entry = NULL;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (i > 0 && info->is_array)
+			pb_info = &info->extra_info;
+		else
+			break;
+
+		ret = read_pb(fd, &obj, pb_info);
+		if (ret < 0)
+			return -1;
+		else if (ret == 0)
+			break;
+
+		if (protobuf_to_json(pb_info->desc, obj, &js_entry)) {
+			pr_err("Can't convert to json");
+			pb_info->free(obj, &pb_allocator);
+			return -1;
+		}
+
+		pb_info->free(obj, &pb_allocator);
+
+		if (cb(data, i, js_entry)) {
+			pr_err("Can't write entry to json");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+struct img_json {
+	json_t	*js;
+	json_t	*js_entries;
+	bool	has_header;
+};
+
+static int set_entry(void *data, int i, json_t *js_entry)
+{
+	struct img_json *ij = data;
+
+	if (i == 0 && ij->has_header)
+		return json_object_set_new(ij->js, "header", js_entry);
+
+	return json_array_append_new(ij->js_entries, js_entry);
+}
+
+int img_read_json(int fd, json_t **js)
+{
+	struct criu_image_info *info;
+	struct img_json ij = {};
+
+	*js = NULL;
+
+	info = img_read_info(fd);
+	if (!info)
+		return -1;
+
+	*js = json_object();
+	if (json_object_set_new(*js, "magic", json_integer(info->magic)) ||
+	    json_object_set_new(*js, "version", json_integer(IMG_JSON_VERSION))) {
+		pr_err("Can't write magic to json\n");
+		goto err;
+	}
+
+	ij.js = *js;
+	ij.has_header = img_has_header(info);
+
+	if (info->is_array) {
+		ij.js_entries = json_array();
+		if (json_object_set_new(*js, "entries", ij.js_entries)) {
+			pr_err("Can't allocate json array for entries\n");
+			goto err;
+		}
+	}
+
+	if (img_for_each_json(fd, info, set_entry, &ij))
+		goto err;
+
+	return 0;
+err:
+	if (*js) {
+		json_decref(*js);
+		*js = NULL;
+	}
+	return -1;
+}
+
+static void dump_key(FILE *f, size_t flags, const char *key, bool first)
+{
+	if (!first)
+		fputc(',', f);
+	json_dump_indent(f, flags, 1, !first);
+	fprintf(f, "\"%s\"%s", key, flags & JSON_COMPACT ? ":" : ": ");
+}
+
+bool img_string_dict;
+
+static int dump_strings(FILE *f, size_t flags, struct intern_dict *dict)
+{
+	const char **strs;
+	unsigned int i, nr;
+	json_t *js;
+	int ret;
+
+	strs = intern_dict_strings(dict, &nr);
+
+	dump_key(f, flags, "strings", false);
+	fputc('[', f);
+	for (i = 0; i < nr; i++) {
+		if (i)
+			fputc(',', f);
+		json_dump_indent(f, flags, 2, i != 0);
+
+		js = json_string(strs[i]);
+		if (!js)
+			return -1;
+		ret = json_dumpf(js, f, flags | JSON_ENCODE_ANY);
+		json_decref(js);
+		if (ret)
+			return -1;
+	}
+	if (nr)
+		json_dump_indent(f, flags, 1, false);
+	fputc(']', f);
+
+	return 0;
+}
+
+int img_stream_json(int fd, FILE *f, size_t flags)
+{
+	struct criu_image_info *info;
+	struct intern_dict *dict = NULL;
+	char *header = NULL;
+	size_t header_len = 0;
+	FILE *hf = NULL;
+	int i, nr_entries = 0, ret = -1;
+
+	info = img_read_info(fd);
+	if (!info)
+		return -1;
+
+	if (img_string_dict) {
+		dict = intern_dict_new();
+		if (!dict) {
+			pr_err("Can't allocate string dictionary\n");
+			return -1;
+		}
+		pb_dump_dict(dict);
+	}
+
+	fputc('{', f);
+	dump_key(f, flags, "magic", true);
+	fprintf(f, "%u", info->magic);
+	dump_key(f, flags, "version", false);
+	fprintf(f, "%d", IMG_JSON_VERSION);
+
+	for (i = 0; ; i++) {
+		struct protobuf_info *pb_info;
+		void *obj;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (info->is_array)
+			pb_info = &info->extra_info;
+		else
+			break;
+
+		ret = read_pb(fd, &obj, pb_info);
+		if (ret < 0)
+			goto out;
+		else if (ret == 0)
+			break;
+
+		/*
+		 * img_read_json() adds "header" after "entries", so it's kept
+		 * aside until entries are done.
+		 */
+		if (i == 0 && img_has_header(info)) {
+			hf = open_memstream(&header, &header_len);
+			ret = hf ? protobuf_dump_json(pb_info->desc, obj, hf, flags, 1) : -1;
+		} else {
+			if (nr_entries++ == 0) {
+				dump_key(f, flags, "entries", false);
+				fputc('[', f);
+			} else
+				fputc(',', f);
+			json_dump_indent(f, flags, 2, nr_entries > 1);
+			ret = protobuf_dump_json(pb_info->desc, obj, f, flags, 2);
+		}
+
+		pb_info->free(obj, &pb_allocator);
+		if (ret) {
+			pr_err("Can't convert entry #%d to json\n", i);
+			goto out;
+		}
+	}
+
+	if (nr_entries) {
+		json_dump_indent(f, flags, 1, false);
+		fputc(']', f);
+	} else if (info->is_array) {
+		dump_key(f, flags, "entries", false);
+		fputs("[]", f);
+	}
+
+	if (hf) {
+		if (fclose(hf)) {
+			hf = NULL;
+			goto out;
+		}
+		hf = NULL;
+		dump_key(f, flags, "header", false);
+		fwrite(header, 1, header_len, f);
+	}
+
+	if (dict && dump_strings(f, flags, dict)) {
+		pr_err("Can't dump string dictionary\n");
+		ret = -1;
+		goto out;
+	}
+
+	json_dump_indent(f, flags, 0, false);
+	fputc('}', f);
+
+	ret = ferror(f) ? -1 : 0;
+out:
+	if (dict) {
+		pb_dump_dict(NULL);
+		intern_dict_free(dict);
+	}
+	if (hf)
+		fclose(hf);
+	free(header);
+	return ret;
+}
+
+int img_load_json(const char *path, json_t **js)
+{
+	int fd, ret;
+	bool intern;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	/* Loaded images are kept around, so their strings are worth sharing */
+	intern = intern_enable(true);
+	ret = img_read_json(fd, js);
+	intern_enable(intern);
+	close(fd);
+
+	return ret;
+}
+
+int img_pack_json(struct protobuf_info *pb_info, json_t *js, void **buf, size_t *len)
+{
+	void *pb = NULL;
+	int pb_size, tag, ret = -1;
+
+	*buf = NULL;
+
+	if (json_to_protobuf(pb_info->desc, js, &pb))
+		goto out;
+
+	pb_size = pb_info->getpksize(pb);
+
+	tag = mem_tag("pack", pb_info->desc->name);
+	*buf = mem_alloc(sizeof(pb_size) + pb_size);
+	mem_untag(tag);
+	if (!*buf) {
+		pr_err("Can't allocate buffer for packed pb object\n");
+		goto out;
+	}
+
+	memcpy(*buf, &pb_size, sizeof(pb_size));
+	if (pb_info->pack(pb, *buf + sizeof(pb_size)) != pb_size) {
+		pr_err("Failed to pack pb object\n");
+		mem_free(*buf);
+		*buf = NULL;
+		goto out;
+	}
+
+	*len = sizeof(pb_size) + pb_size;
+	ret = 0;
+out:
+	if (pb)
+		pb_info->free(pb, &pb_allocator);
+	return ret;
+}
+
+int img_write_json(json_t *js, int fd_out)
+{
+	uint32_t magic;
+	int i = 0, ret = -1;
+	json_t *js_magic, *js_version;
+	json_t *js_header, *js_entries;
+	json_t *js_value;
+	json_int_t version;
+	void *buf;
+	size_t len;
+	char name[16];
+	struct criu_image_info *info = NULL;
+
+	js_magic = json_object_get(js, "magic");
+	if (!js_magic) {
+		pr_err("No magic key found\n");
+		goto out;
+	}
+
+	magic = (uint32_t)json_integer_value(js_magic);
+
+	js_header = json_object_get(js, "header");
+	js_entries = json_object_get(js, "entries");
+
+	/* Old layout has no version, it's told apart by the numbered keys */
+	js_version = json_object_get(js, "version");
+	if (js_version && !json_is_integer(js_version)) {
+		pr_err("Bad version\n");
+		goto out;
+	}
+
+	version = js_version ? json_integer_value(js_version) :
+			       js_header || js_entries ? IMG_JSON_VERSION : 1;
+	if (version != 1 && version != IMG_JSON_VERSION) {
+		pr_err("Unsupported version %lld\n", (long long)version);
+		goto out;
+	}
+	if (version == 1)
+		js_header = js_entries = NULL;
+
+	info = find_img_info(magic);
+	if (!info) {
+		pr_err("Unknown magic\n");
+		goto out;
+	}
+
+	/* Entries of header images never stand in for the missing header */
+	if (version != 1 && !js_header && img_has_header(info) &&
+	    json_array_size(js_entries)) {
+		pr_err("No header for entries\n");
+		goto out;
+	}
+
+	ret = write_all(fd_out, &magic, sizeof(magic));
+	if (ret) {
+		pr_err("Can't write magic to img\n");
+		goto out;
+	}
+
+	/* Dictionary of to-json --string-dict, if it was used */
+	pb_load_dict(json_object_get(js, "strings"));
+
+	for (i = 0; ; i++) {
+		struct protobuf_info *pb_info = NULL;
+
+		ret = -1;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (i > 0 && info->is_array)
+			pb_info = &info->extra_info;
+		else
+			break;
+
+		/* Walked directly, without img_json_entry() lookups of the layout */
+		if (version == 1) {
+			snprintf(name, sizeof(name), "%d", i);
+			js_value = json_object_get(js, name);
+		} else if (js_header && i == 0)
+			js_value = js_header;
+		else
+			js_value = json_array_get(js_entries, js_header ? i - 1 : i);
+		if (!js_value)
+			break;
+
+		ret = img_pack_json(pb_info, js_value, &buf, &len);
+		if (ret) {
+			pr_err("Can't convert json object #%d to protobuf\n", i);
+			goto out;
+		}
+
+		ret = write_all(fd_out, buf, len);
+		mem_free(buf);
+		if (ret) {
+			pr_err("Can't write #%d object\n", i);
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	pb_load_dict(NULL);
+	return ret;
+}
+
+int img_to_json(const char *in, const char *out)
+{
+	int fd_in, ret = -1, tag;
+	FILE *f = NULL;
+
+	fd_in = img_open(in, O_RDONLY);
+	if (fd_in < 0)
+		goto out;
+
+	f = img_fopen(out, "w");
+	if (!f)
+		goto out;
+
+	/* Entries are dumped as they are read, whole json is never built */
+	tag = mem_tag("dump", NULL);
+	ret = img_stream_json(fd_in, f, JSON_INDENT(4));
+	mem_untag(tag);
+	if (ret)
+		pr_err("Can't dump json object");
+out:
+	if (f && fclose(f)) {
+		pr_perror("Can't write output file");
+		ret = -1;
+	}
+	if (fd_in >= 0)
+		close(fd_in);
+	return ret;
+}
+
+int json_to_img(const char *in, const char *out)
+{
+	int fd_out = -1, ret = -1, tag;
+	json_t *js = NULL;
+	json_error_t jerror;
+	FILE *f;
+
+	f = img_fopen(in, "r");
+	if (!f)
+		goto out;
+
+	tag = mem_tag("load", NULL);
+	js = json_loadf(f, 0, &jerror);
+	mem_untag(tag);
+	fclose(f);
+	if (!js) {
+		pr_err("json parsing error at line %d col %d pos %d: %s\n",
+			jerror.line, jerror.column, jerror.position, jerror.text);
+		goto out;
+	}
+
+	fd_out = img_open(out, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd_out < 0)
+		goto out;
+
+	if (json_object_get(js, "shards"))
+		ret = shards_to_img(js, in, fd_out);
+	else
+		ret = img_write_json(js, fd_out);
+out:
+	if (js)
+		json_decref(js);
+	if (fd_out >= 0)
+		close(fd_out);
+	return ret;
+}
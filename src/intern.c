@@ -0,0 +1,277 @@
+#include <jansson.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "log.h"
+#include "mem.h"
+#include "intern.h"
+
+#define INTERN_MIN_SIZE		1024
+#define INTERN_MAX_LEN		512
+#define INTERN_MAX_ENTRIES	(1 << 16)
+#define INTERN_MAX_BYTES	(8 << 20)
+
+/* str is json_string_value(js) for nodes, own copy for dictionaries */
+struct intern_entry {
+	unsigned int	hash;
+	const char	*str;
+	json_t		*js;
+	unsigned int	idx;
+};
+
+struct intern_table {
+	struct intern_entry	*entries;
+	unsigned int		size;
+	unsigned int		nr;
+	size_t			bytes;
+};
+
+/*
+ * jansson refcounting isn't atomic, so nodes can't be shared between
+ * threads and each worker gets a table of its own. It is freed when
+ * the worker exits, the main thread one in intern_fini().
+ */
+static __thread struct intern_table *table;
+static __thread bool interning;
+
+static pthread_key_t table_key;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static unsigned int intern_hash(const char *str)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *str; str++)
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+
+	return hash;
+}
+
+static struct intern_entry *intern_lookup(struct intern_table *t, const char *str,
+					  unsigned int hash)
+{
+	unsigned int i;
+
+	for (i = hash & (t->size - 1); t->entries[i].str; i = (i + 1) & (t->size - 1)) {
+		if (t->entries[i].hash == hash && !strcmp(t->entries[i].str, str))
+			break;
+	}
+
+	return &t->entries[i];
+}
+
+static int intern_grow(struct intern_table *t)
+{
+	struct intern_entry *old = t->entries;
+	unsigned int i, old_size = t->size;
+
+	t->size = old_size ? old_size * 2 : INTERN_MIN_SIZE;
+	t->entries = mem_alloc(t->size * sizeof(*t->entries));
+	if (!t->entries) {
+		t->entries = old;
+		t->size = old_size;
+		return -1;
+	}
+	memset(t->entries, 0, t->size * sizeof(*t->entries));
+
+	for (i = 0; i < old_size; i++)
+		if (old[i].str)
+			*intern_lookup(t, old[i].str, old[i].hash) = old[i];
+	mem_free(old);
+
+	return 0;
+}
+
+static void intern_free(void *data)
+{
+	struct intern_table *t = data;
+	unsigned int i;
+
+	for (i = 0; i < t->size; i++)
+		if (t->entries[i].js)
+			json_decref(t->entries[i].js);
+	mem_free(t->entries);
+	mem_free(t);
+}
+
+static void intern_key_init(void)
+{
+	if (pthread_key_create(&table_key, intern_free))
+		pr_err("Can't create intern table key\n");
+}
+
+static struct intern_table *intern_table(void)
+{
+	if (table)
+		return table;
+
+	table = mem_alloc(sizeof(*table));
+	if (!table)
+		return NULL;
+	memset(table, 0, sizeof(*table));
+
+	if (intern_grow(table)) {
+		mem_free(table);
+		table = NULL;
+		return NULL;
+	}
+
+	pthread_once(&table_once, intern_key_init);
+	pthread_setspecific(table_key, table);
+
+	return table;
+}
+
+bool intern_enable(bool on)
+{
+	bool prev = interning;
+
+	interning = on;
+	return prev;
+}
+
+json_t *json_string_interned(const char *str)
+{
+	struct intern_table *t;
+	struct intern_entry *e;
+	unsigned int hash;
+	size_t len;
+	json_t *js;
+
+	if (!interning)
+		return json_string(str);
+
+	len = strlen(str);
+	t = intern_table();
+	if (!t || len >= INTERN_MAX_LEN)
+		return json_string(str);
+
+	hash = intern_hash(str);
+	e = intern_lookup(t, str, hash);
+	if (e->str)
+		return json_incref(e->js);
+
+	js = json_string(str);
+	if (!js)
+		return NULL;
+
+	/* Once full, unique strings just stop being interned */
+	if (t->nr >= INTERN_MAX_ENTRIES || t->bytes + len > INTERN_MAX_BYTES)
+		return js;
+
+	if ((t->nr + 1) * 2 > t->size) {
+		if (intern_grow(t))
+			return js;
+		e = intern_lookup(t, str, hash);
+	}
+
+	e->hash = hash;
+	e->js = json_incref(js);
+	e->str = json_string_value(js);
+	t->nr++;
+	t->bytes += len;
+
+	return js;
+}
+
+void intern_fini(void)
+{
+	if (!table)
+		return;
+
+	pthread_setspecific(table_key, NULL);
+	intern_free(table);
+	table = NULL;
+}
+
+struct intern_dict {
+	struct intern_table	t;
+	const char		**strs;
+};
+
+struct intern_dict *intern_dict_new(void)
+{
+	struct intern_dict *d;
+
+	d = mem_alloc(sizeof(*d));
+	if (!d)
+		return NULL;
+	memset(d, 0, sizeof(*d));
+
+	if (intern_grow(&d->t)) {
+		mem_free(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+int intern_dict_add(struct intern_dict *d, const char *str)
+{
+	struct intern_table *t = &d->t;
+	struct intern_entry *e;
+	unsigned int hash;
+	size_t len;
+	char *copy;
+
+	len = strlen(str);
+	if (len >= INTERN_MAX_LEN)
+		return -1;
+
+	hash = intern_hash(str);
+	e = intern_lookup(t, str, hash);
+	if (e->str)
+		return e->idx;
+
+	/* Once full, the rest of strings are just dumped in place */
+	if (t->nr >= INTERN_MAX_ENTRIES || t->bytes + len > INTERN_MAX_BYTES)
+		return -1;
+
+	if ((t->nr + 1) * 2 > t->size) {
+		if (intern_grow(t))
+			return -1;
+		e = intern_lookup(t, str, hash);
+	}
+
+	/* strs doubles whenever nr reaches a power of two */
+	if (t->nr == 0 || (t->nr & (t->nr - 1)) == 0) {
+		const char **strs = mem_realloc(d->strs, (t->nr ? t->nr * 2 : 1) * sizeof(*strs));
+
+		if (!strs)
+			return -1;
+		d->strs = strs;
+	}
+
+	copy = mem_strdup(str);
+	if (!copy)
+		return -1;
+
+	e->hash = hash;
+	e->str = copy;
+	e->idx = t->nr;
+	d->strs[t->nr++] = copy;
+	t->bytes += len;
+
+	return e->idx;
+}
+
+const char **intern_dict_strings(struct intern_dict *d, unsigned int *nr)
+{
+	*nr = d->t.nr;
+	return d->strs;
+}
+
+void intern_dict_free(struct intern_dict *d)
+{
+	unsigned int i;
+
+	if (!d)
+		return;
+
+	for (i = 0; i < d->t.nr; i++)
+		mem_free((void *)d->strs[i]);
+	mem_free(d->strs);
+	mem_free(d->t.entries);
+	mem_free(d);
+}
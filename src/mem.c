@@ -0,0 +1,369 @@
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "mem.h"
+
+/* Keeps the returned memory aligned the same way malloc() does */
+#define MEM_HDR_SIZE	16
+
+/* Stored right before the returned memory */
+struct mem_hdr {
+	size_t		size;
+	uint32_t	tag;
+};
+
+static size_t mem_limit;
+static size_t mem_used;
+static int mem_exceeded;
+
+/*
+ * Heap profile. Every allocation is accounted to the current tag of the
+ * calling thread, i.e. conversion phase and message type set by mem_tag().
+ * Tag 0 in the header means the allocation isn't profiled.
+ */
+#define MEM_MAX_TAGS	1024
+
+struct mem_stat {
+	const char	*phase;
+	const char	*msg;
+	size_t		count;
+	size_t		bytes;
+	size_t		live;
+	size_t		peak;
+};
+
+static FILE *mem_profile;
+static size_t mem_peak;
+static struct mem_stat mem_stats[MEM_MAX_TAGS];
+static int mem_nr_stats;
+static pthread_mutex_t mem_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int mem_cur_tag;
+
+static void mem_update_peak(size_t *peak, size_t live)
+{
+	size_t old = *peak;
+
+	while (live > old && !__sync_bool_compare_and_swap(peak, old, live))
+		old = *peak;
+}
+
+static void mem_account(struct mem_hdr *hdr, size_t size)
+{
+	struct mem_stat *st;
+
+	hdr->tag = 0;
+	if (!mem_profile)
+		return;
+
+	hdr->tag = mem_cur_tag + 1;
+	st = &mem_stats[mem_cur_tag];
+	__sync_add_and_fetch(&st->count, 1);
+	__sync_add_and_fetch(&st->bytes, size);
+	mem_update_peak(&st->peak, __sync_add_and_fetch(&st->live, size));
+	mem_update_peak(&mem_peak, mem_used);
+}
+
+/* Accounts size more bytes in use, fails if that exceeds the budget */
+static int mem_reserve(size_t size)
+{
+	size_t used;
+
+	used = __sync_add_and_fetch(&mem_used, size);
+	if (mem_limit && used > mem_limit) {
+		__sync_sub_and_fetch(&mem_used, size);
+		if (!__sync_fetch_and_add(&mem_exceeded, 1))
+			pr_err("Memory budget of %zu bytes exceeded\n", mem_limit);
+		return -1;
+	}
+
+	return 0;
+}
+
+void *mem_alloc(size_t size)
+{
+	char *ptr;
+
+	if (size > SIZE_MAX - MEM_HDR_SIZE || mem_reserve(size + MEM_HDR_SIZE))
+		return NULL;
+
+	ptr = malloc(size + MEM_HDR_SIZE);
+	if (!ptr) {
+		__sync_sub_and_fetch(&mem_used, size + MEM_HDR_SIZE);
+		return NULL;
+	}
+
+	((struct mem_hdr *)ptr)->size = size;
+	mem_account((struct mem_hdr *)ptr, size);
+	return ptr + MEM_HDR_SIZE;
+}
+
+void mem_free(void *ptr)
+{
+	struct mem_hdr *hdr;
+
+	if (!ptr)
+		return;
+
+	hdr = (struct mem_hdr *)((char *)ptr - MEM_HDR_SIZE);
+	if (hdr->tag)
+		__sync_sub_and_fetch(&mem_stats[hdr->tag - 1].live, hdr->size);
+	__sync_sub_and_fetch(&mem_used, hdr->size + MEM_HDR_SIZE);
+	free(hdr);
+}
+
+void *mem_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	ptr = mem_alloc(nmemb * size);
+	if (ptr)
+		memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+/* Growing counts against the budget, the memory keeps its original tag */
+void *mem_realloc(void *ptr, size_t size)
+{
+	struct mem_hdr *hdr;
+	size_t old;
+
+	if (!ptr)
+		return mem_alloc(size);
+
+	if (size > SIZE_MAX - MEM_HDR_SIZE)
+		return NULL;
+
+	hdr = (struct mem_hdr *)((char *)ptr - MEM_HDR_SIZE);
+	old = hdr->size;
+	if (size > old && mem_reserve(size - old))
+		return NULL;
+
+	hdr = realloc(hdr, size + MEM_HDR_SIZE);
+	if (!hdr) {
+		if (size > old)
+			__sync_sub_and_fetch(&mem_used, size - old);
+		return NULL;
+	}
+
+	if (size < old)
+		__sync_sub_and_fetch(&mem_used, old - size);
+
+	if (hdr->tag) {
+		struct mem_stat *st = &mem_stats[hdr->tag - 1];
+
+		/* Unsigned wrap around makes shrinking work too */
+		if (size > old)
+			__sync_add_and_fetch(&st->bytes, size - old);
+		mem_update_peak(&st->peak, __sync_add_and_fetch(&st->live, size - old));
+		mem_update_peak(&mem_peak, mem_used);
+	}
+
+	hdr->size = size;
+	return (char *)hdr + MEM_HDR_SIZE;
+}
+
+char *mem_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *dup;
+
+	dup = mem_alloc(len);
+	if (dup)
+		memcpy(dup, str, len);
+
+	return dup;
+}
+
+static void *pb_mem_alloc(void *allocator_data, size_t size)
+{
+	return mem_alloc(size);
+}
+
+static void pb_mem_free(void *allocator_data, void *ptr)
+{
+	mem_free(ptr);
+}
+
+ProtobufCAllocator pb_allocator = {
+	.alloc		= pb_mem_alloc,
+	.free		= pb_mem_free,
+#ifndef PROTOBUF_C_VERSION_NUMBER
+	/* protobuf-c 0.x wants temporary allocations helper too */
+	.tmp_alloc	= pb_mem_alloc,
+	.max_alloca	= 8192,
+#endif
+	.allocator_data	= NULL,
+};
+
+void mem_init(void)
+{
+	json_set_alloc_funcs(mem_alloc, mem_free);
+}
+
+/* Accepts plain bytes or K, M, G suffixed sizes */
+int parse_size(const char *str, size_t *psize)
+{
+	unsigned long long size;
+	int shift = 0;
+	char *end;
+
+	/* strtoull() would take "-1" for the biggest size */
+	if (*str < '0' || *str > '9')
+		goto bad;
+
+	errno = 0;
+	size = strtoull(str, &end, 10);
+	if (errno == ERANGE)
+		goto bad;
+
+	switch (*end) {
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		end++;
+	}
+
+	if (*end != '\0' || size == 0 || size > (ULLONG_MAX >> shift) ||
+	    (size << shift) > SIZE_MAX)
+		goto bad;
+
+	*psize = size << shift;
+	return 0;
+bad:
+	pr_err("Bad size %s\n", str);
+	return -1;
+}
+
+int mem_set_limit(const char *str)
+{
+	return parse_size(str, &mem_limit);
+}
+
+/* Past this point new parallel work should wait for running one */
+bool mem_pressure(void)
+{
+	return mem_limit && mem_used > mem_limit / 4 * 3;
+}
+
+static int mem_find_tag(const char *phase, const char *msg)
+{
+	int i;
+
+	for (i = 0; i < mem_nr_stats; i++)
+		if (!strcmp(mem_stats[i].phase, phase) &&
+		    !strcmp(mem_stats[i].msg, msg))
+			return i;
+
+	if (mem_nr_stats == MEM_MAX_TAGS)
+		return 0;
+
+	mem_stats[i].phase = phase;
+	mem_stats[i].msg = msg;
+	mem_nr_stats++;
+	return i;
+}
+
+/*
+ * Accounts following allocations of the calling thread to PHASE and MSG,
+ * which have to be static strings (like descriptor names). Returns the
+ * previous tag to be put back with mem_untag().
+ */
+int mem_tag(const char *phase, const char *msg)
+{
+	int prev = mem_cur_tag;
+
+	if (!mem_profile)
+		return prev;
+
+	pthread_mutex_lock(&mem_stats_lock);
+	mem_cur_tag = mem_find_tag(phase, msg ? msg : "-");
+	pthread_mutex_unlock(&mem_stats_lock);
+
+	return prev;
+}
+
+void mem_untag(int prev)
+{
+	mem_cur_tag = prev;
+}
+
+int mem_set_profile(const char *path)
+{
+	mem_profile = fopen(path, "w");
+	if (!mem_profile) {
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	mem_stats[0].phase = "other";
+	mem_stats[0].msg = "-";
+	mem_nr_stats = 1;
+	return 0;
+}
+
+static int mem_stat_cmp(const void *a, const void *b)
+{
+	const struct mem_stat *sa = *(const struct mem_stat **)a;
+	const struct mem_stat *sb = *(const struct mem_stat **)b;
+
+	return sa->bytes < sb->bytes ? 1 : sa->bytes > sb->bytes ? -1 : 0;
+}
+
+/*
+ * Writes allocation counts, bytes, peak live bytes and bytes still live
+ * (leaked) per tag, biggest first. Leaks are only meaningful once all
+ * conversion results are freed, so this is called right before exit.
+ */
+void mem_report(void)
+{
+	struct mem_stat total = { .phase = "total", .msg = "-" };
+	struct mem_stat *sorted[MEM_MAX_TAGS];
+	FILE *f = mem_profile;
+	int i;
+
+	if (!f)
+		return;
+
+	/* Headers of live allocations still refer to mem_stats[] slots */
+	for (i = 0; i < mem_nr_stats; i++)
+		sorted[i] = &mem_stats[i];
+	qsort(sorted, mem_nr_stats, sizeof(sorted[0]), mem_stat_cmp);
+
+	fprintf(f, "%-10s %-32s %12s %16s %16s %16s\n",
+		"phase", "message", "allocs", "bytes", "peak", "leaked");
+	for (i = 0; i < mem_nr_stats; i++) {
+		struct mem_stat *st = sorted[i];
+
+		if (!st->count)
+			continue;
+
+		fprintf(f, "%-10s %-32s %12zu %16zu %16zu %16zu\n",
+			st->phase, st->msg, st->count, st->bytes, st->peak, st->live);
+		total.count += st->count;
+		total.bytes += st->bytes;
+		total.live += st->live;
+	}
+
+	/* Overall peak includes allocation headers, like --max-memory does */
+	fprintf(f, "%-10s %-32s %12zu %16zu %16zu %16zu\n",
+		total.phase, total.msg, total.count, total.bytes, mem_peak, total.live);
+
+	fclose(f);
+	mem_profile = NULL;
+}
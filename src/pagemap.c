@@ -0,0 +1,686 @@
+#define _GNU_SOURCE
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "log.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "pool.h"
+#include "pagemap.h"
+
+/*
+ * pagemap mode resolves pages of a pre-dump chain. Pagemap entries marked
+ * in_parent (PE_PARENT) keep their pages in the dump behind the "parent"
+ * symlink, which may defer them further. Levels are numbered from the
+ * given directory (0) up the chain, and for every vma of every process
+ * the ranges of dumped pages are reported with the level holding them:
+ *
+ * {"levels": [{"dir": D, "pages": N, "lazy": N}, ...],
+ *  "processes": [{"pid": P, "vmas": [{"start": S, "end": E,
+ *		"pages": [{"start": S, "end": E, "level": L}, ...]}]}],
+ *  "missing": N}
+ *
+ * Lazy pages get "lazy": true, pages a level defers to a parent that
+ * doesn't have them get "missing": true instead of a level.
+ *
+ * Each level is turned into per-process sorted range tables, loaded in
+ * parallel, and saved to PM_CACHE in the level directory. Later runs
+ * reuse it as long as pagemap images keep their sizes and mtimes.
+ */
+
+#define PM_CACHE	".criu2json-pagemap.idx"
+#define PM_CACHE_MAGIC	"CRPMIDX1"
+#define PM_MAX_LEVELS	64
+
+/* pagemap_entry flags */
+#define PE_PARENT	(1 << 0)
+#define PE_LAZY		(1 << 1)
+
+enum {
+	PM_PRESENT,
+	PM_PARENT,
+	PM_LAZY,
+};
+
+struct pm_range {
+	uint64_t	start;
+	uint64_t	end;
+	uint32_t	kind;
+};
+
+struct pm_map {
+	int32_t		pid;
+	int64_t		mtime;
+	int64_t		size;
+	uint32_t	nr;
+	struct pm_range	*r;
+};
+
+struct pm_level {
+	char		dir[PATH_MAX];
+	struct pm_map	*maps;
+	int		nr_maps;
+	unsigned long	pages;
+	unsigned long	lazy;
+};
+
+struct pm_run {
+	uint64_t	start;
+	uint64_t	end;
+	int		level;
+	bool		lazy;
+};
+
+struct pm_chain {
+	struct pm_level	levels[PM_MAX_LEVELS];
+	int		nr_levels;
+	unsigned long	missing;
+	long		page_size;
+
+	/* runs of the vma being resolved */
+	struct pm_run	*runs;
+	int		nr_runs;
+	int		max_runs;
+};
+
+static int pm_filter(const struct dirent *d)
+{
+	int pid;
+	char c;
+
+	return sscanf(d->d_name, "pagemap-%d.im%c", &pid, &c) == 2 && c == 'g';
+}
+
+static int64_t mtime_ns(struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct pm_range *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static int map_cmp(const void *a, const void *b)
+{
+	const struct pm_map *ma = a, *mb = b;
+
+	return ma->pid - mb->pid;
+}
+
+static int json_u64(json_t *js, const char *key, uint64_t *val)
+{
+	json_t *js_val = json_object_get(js, key);
+
+	if (!json_is_integer(js_val))
+		return -1;
+
+	*val = (uint64_t)json_integer_value(js_val);
+	return 0;
+}
+
+static int add_range(struct pm_map *m, PagemapEntry *pe, long page_size)
+{
+	struct pm_range *r;
+	uint32_t flags;
+
+	if ((m->nr & (m->nr - 1)) == 0) {
+		r = mem_realloc(m->r, (m->nr ? m->nr * 2 : 1) * sizeof(*r));
+		if (!r)
+			return -1;
+		m->r = r;
+	}
+
+	if (pe->has_flags)
+		flags = pe->flags;
+	else
+		flags = pe->has_in_parent && pe->in_parent ? PE_PARENT : 0;
+
+	r = &m->r[m->nr++];
+	r->start = pe->vaddr;
+	r->end = pe->vaddr + (uint64_t)pe->nr_pages * page_size;
+	if (flags & PE_PARENT)
+		r->kind = PM_PARENT;
+	else if (flags & PE_LAZY)
+		r->kind = PM_LAZY;
+	else
+		r->kind = PM_PRESENT;
+
+	return 0;
+}
+
+/* Entries are unpacked one by one, only vaddr, nr_pages and flags are kept */
+static int load_map(struct pm_chain *c, const char *path, struct pm_map *m)
+{
+	struct criu_image_info *info;
+	PagemapEntry *pe;
+	uint32_t magic;
+	void *obj;
+	int fd, i, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	if (read_all(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+	    !(info = find_img_info(magic)) ||
+	    info->extra_info.desc != &pagemap_entry__descriptor) {
+		pr_err("%s: not a pagemap image\n", path);
+		goto out;
+	}
+
+	/* entry #0 is pagemap_head */
+	if (read_pb(fd, &obj, &info->header_info) <= 0) {
+		pr_err("%s: no pagemap head\n", path);
+		goto out;
+	}
+	info->header_info.free(obj, &pb_allocator);
+
+	for (i = 1; ; i++) {
+		ret = read_pb(fd, (void **)&pe, &info->extra_info);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			pr_err("%s: bad entry #%d\n", path, i);
+			goto out;
+		}
+
+		ret = add_range(m, pe, c->page_size);
+		info->extra_info.free(pe, &pb_allocator);
+		if (ret) {
+			pr_err("Can't allocate ranges of %s\n", path);
+			goto out;
+		}
+	}
+
+	qsort(m->r, m->nr, sizeof(*m->r), range_cmp);
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static void free_level(struct pm_level *l)
+{
+	int i;
+
+	for (i = 0; i < l->nr_maps; i++)
+		mem_free(l->maps[i].r);
+	mem_free(l->maps);
+	l->maps = NULL;
+	l->nr_maps = 0;
+}
+
+/* Cache is valid if it lists the same pagemap images, sizes and mtimes */
+static int read_cache(struct pm_level *l, struct pm_map *imgs, int n)
+{
+	char path[PATH_MAX], magic[8];
+	uint32_t nr_maps;
+	int i, ret = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", l->dir, PM_CACHE);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, PM_CACHE_MAGIC, sizeof(magic)) ||
+	    fread(&nr_maps, sizeof(nr_maps), 1, f) != 1 || nr_maps != n)
+		goto out;
+
+	l->maps = mem_calloc(n ? n : 1, sizeof(*l->maps));
+	if (!l->maps)
+		goto out;
+	l->nr_maps = n;
+
+	for (i = 0; i < n; i++) {
+		struct pm_map *m = &l->maps[i];
+
+		if (fread(&m->pid, sizeof(m->pid), 1, f) != 1 ||
+		    fread(&m->mtime, sizeof(m->mtime), 1, f) != 1 ||
+		    fread(&m->size, sizeof(m->size), 1, f) != 1 ||
+		    fread(&m->nr, sizeof(m->nr), 1, f) != 1)
+			goto out;
+
+		if (m->pid != imgs[i].pid || m->mtime != imgs[i].mtime ||
+		    m->size != imgs[i].size)
+			goto out;
+
+		m->r = mem_calloc(m->nr ? m->nr : 1, sizeof(*m->r));
+		if (!m->r || fread(m->r, sizeof(*m->r), m->nr, f) != m->nr)
+			goto out;
+	}
+
+	ret = 0;
+out:
+	if (ret)
+		free_level(l);
+	fclose(f);
+	return ret;
+}
+
+static void write_cache(struct pm_level *l)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	uint32_t nr_maps = l->nr_maps;
+	bool ok;
+	FILE *f;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s", l->dir, PM_CACHE);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+
+	/* Read-only dumps are fine, they're just indexed every time */
+	f = fopen(tmp, "w");
+	if (!f) {
+		pr_info("Can't write pagemap index to %s\n", l->dir);
+		return;
+	}
+
+	ok = fwrite(PM_CACHE_MAGIC, 8, 1, f) == 1 &&
+	     fwrite(&nr_maps, sizeof(nr_maps), 1, f) == 1;
+
+	for (i = 0; ok && i < l->nr_maps; i++) {
+		struct pm_map *m = &l->maps[i];
+
+		ok = fwrite(&m->pid, sizeof(m->pid), 1, f) == 1 &&
+		     fwrite(&m->mtime, sizeof(m->mtime), 1, f) == 1 &&
+		     fwrite(&m->size, sizeof(m->size), 1, f) == 1 &&
+		     fwrite(&m->nr, sizeof(m->nr), 1, f) == 1 &&
+		     fwrite(m->r, sizeof(*m->r), m->nr, f) == m->nr;
+	}
+
+	if (fclose(f) || !ok || rename(tmp, path)) {
+		pr_info("Can't write pagemap index to %s\n", l->dir);
+		unlink(tmp);
+	}
+}
+
+static int load_level(void *arg, int idx)
+{
+	struct pm_chain *c = arg;
+	struct pm_level *l = &c->levels[idx];
+	struct dirent **names;
+	struct pm_map *imgs;
+	char path[PATH_MAX];
+	struct stat st;
+	int n, i, j, ret = -1;
+
+	n = scandir(l->dir, &names, pm_filter, NULL);
+	if (n < 0) {
+		pr_perror("Can't scan %s", l->dir);
+		return -1;
+	}
+
+	imgs = mem_calloc(n ? n : 1, sizeof(*imgs));
+	if (!imgs)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", l->dir, names[i]->d_name);
+		if (stat(path, &st)) {
+			pr_perror("Can't stat %s", path);
+			goto out;
+		}
+
+		sscanf(names[i]->d_name, "pagemap-%d", &imgs[i].pid);
+		imgs[i].mtime = mtime_ns(&st);
+		imgs[i].size = st.st_size;
+	}
+	qsort(imgs, n, sizeof(*imgs), map_cmp);
+
+	if (!read_cache(l, imgs, n)) {
+		pr_info("Using pagemap index of %s\n", l->dir);
+		mem_free(imgs);
+		imgs = NULL;
+	} else {
+		for (i = 0; i < n; i++) {
+			snprintf(path, sizeof(path), "%s/pagemap-%d.img", l->dir, imgs[i].pid);
+			if (load_map(c, path, &imgs[i]))
+				goto out;
+		}
+
+		l->maps = imgs;
+		l->nr_maps = n;
+		imgs = NULL;
+		write_cache(l);
+	}
+
+	ret = 0;
+out:
+	if (imgs) {
+		for (j = 0; j < n; j++)
+			mem_free(imgs[j].r);
+		mem_free(imgs);
+	}
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+	return ret;
+}
+
+static struct pm_map *find_map(struct pm_level *l, int pid)
+{
+	struct pm_map key = { .pid = pid };
+
+	return bsearch(&key, l->maps, l->nr_maps, sizeof(key), map_cmp);
+}
+
+static int add_run(struct pm_chain *c, uint64_t start, uint64_t end, int level, bool lazy)
+{
+	struct pm_run *run = c->nr_runs ? &c->runs[c->nr_runs - 1] : NULL;
+	unsigned long pages = (end - start) / c->page_size;
+
+	if (level < 0)
+		c->missing += pages;
+	else if (lazy)
+		c->levels[level].lazy += pages;
+	else
+		c->levels[level].pages += pages;
+
+	if (run && run->end == start && run->level == level && run->lazy == lazy) {
+		run->end = end;
+		return 0;
+	}
+
+	if (c->nr_runs == c->max_runs) {
+		int max = c->max_runs ? c->max_runs * 2 : 64;
+
+		run = mem_realloc(c->runs, max * sizeof(*run));
+		if (!run) {
+			pr_err("Can't allocate page runs\n");
+			return -1;
+		}
+		c->runs = run;
+		c->max_runs = max;
+	}
+
+	c->runs[c->nr_runs++] = (struct pm_run){ start, end, level, lazy };
+	return 0;
+}
+
+/*
+ * Emits runs of [start, end) as seen from level. When a child level
+ * deferred the range here (must_have), pages not found are missing.
+ */
+static int resolve(struct pm_chain *c, int level, int pid, uint64_t start,
+		   uint64_t end, bool must_have)
+{
+	struct pm_map *m = NULL;
+	uint64_t pos = start;
+	uint32_t lo, hi;
+
+	if (level < c->nr_levels)
+		m = find_map(&c->levels[level], pid);
+
+	if (m) {
+		/* first range ending past start */
+		for (lo = 0, hi = m->nr; lo < hi; ) {
+			uint32_t mid = (lo + hi) / 2;
+
+			if (m->r[mid].end <= start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (; lo < m->nr && m->r[lo].start < end; lo++) {
+			struct pm_range *r = &m->r[lo];
+			uint64_t s = r->start > pos ? r->start : pos;
+			uint64_t e = r->end < end ? r->end : end;
+
+			if (s > pos && must_have && add_run(c, pos, s, -1, false))
+				return -1;
+
+			if (r->kind == PM_PARENT) {
+				if (resolve(c, level + 1, pid, s, e, true))
+					return -1;
+			} else if (add_run(c, s, e, level, r->kind == PM_LAZY))
+				return -1;
+
+			pos = e;
+		}
+	}
+
+	if (pos < end && must_have)
+		return add_run(c, pos, end, -1, false);
+
+	return 0;
+}
+
+static json_t *runs_to_json(struct pm_chain *c)
+{
+	json_t *pages, *run;
+	int i;
+
+	pages = json_array();
+	for (i = 0; pages && i < c->nr_runs; i++) {
+		struct pm_run *r = &c->runs[i];
+
+		run = json_object();
+		if (!run || json_array_append_new(pages, run) ||
+		    json_object_set_new(run, "start", json_integer(r->start)) ||
+		    json_object_set_new(run, "end", json_integer(r->end)) ||
+		    (r->level < 0 ?
+		     json_object_set_new(run, "missing", json_true()) :
+		     json_object_set_new(run, "level", json_integer(r->level))) ||
+		    (r->lazy && json_object_set_new(run, "lazy", json_true()))) {
+			json_decref(pages);
+			return NULL;
+		}
+	}
+
+	return pages;
+}
+
+/* Both vmas-PID.img of old dumps and vmas of mm-PID.img are understood */
+static json_t *load_vmas(const char *dir, int pid, json_t **js)
+{
+	char path[PATH_MAX];
+	json_t *vmas;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/vmas-%d.img", dir, pid);
+	if (!access(path, F_OK)) {
+		if (img_load_json(path, js))
+			return NULL;
+
+		vmas = json_array();
+		for (i = 0; vmas && img_json_entry(*js, i); i++)
+			json_array_append_new(vmas, json_incref(img_json_entry(*js, i)));
+		return vmas;
+	}
+
+	snprintf(path, sizeof(path), "%s/mm-%d.img", dir, pid);
+	if (img_load_json(path, js))
+		return NULL;
+
+	vmas = json_object_get(img_json_entry(*js, 0), "vmas");
+	return vmas ? json_incref(vmas) : json_array();
+}
+
+static int resolve_proc(struct pm_chain *c, int pid, json_t *proc)
+{
+	json_t *js = NULL, *vmas, *vma, *pages;
+	uint64_t start, end;
+	size_t i;
+	int ret = -1;
+
+	vmas = load_vmas(c->levels[0].dir, pid, &js);
+	if (!vmas) {
+		pr_err("Can't load vmas of %d\n", pid);
+		goto out;
+	}
+
+	json_array_foreach(vmas, i, vma) {
+		json_t *js_vma;
+
+		if (json_u64(vma, "start", &start) || json_u64(vma, "end", &end)) {
+			pr_err("Bad vma #%zu of %d\n", i, pid);
+			goto out;
+		}
+
+		c->nr_runs = 0;
+		if (resolve(c, 0, pid, start, end, false))
+			goto out;
+
+		pages = runs_to_json(c);
+		js_vma = json_object();
+		if (!pages || !js_vma ||
+		    json_object_set_new(js_vma, "start", json_integer(start)) ||
+		    json_object_set_new(js_vma, "end", json_integer(end)) ||
+		    json_object_set_new(js_vma, "pages", pages) ||
+		    json_array_append_new(json_object_get(proc, "vmas"), js_vma)) {
+			pr_err("Can't build vma json\n");
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	if (vmas)
+		json_decref(vmas);
+	if (js)
+		json_decref(js);
+	return ret;
+}
+
+static int find_levels(struct pm_chain *c, const char *dir)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (!realpath(dir, c->levels[0].dir)) {
+		pr_perror("Can't resolve %s", dir);
+		return -1;
+	}
+
+	for (c->nr_levels = 1; c->nr_levels < PM_MAX_LEVELS; c->nr_levels++) {
+		struct pm_level *l = &c->levels[c->nr_levels];
+
+		snprintf(path, sizeof(path), "%s/parent", l[-1].dir);
+		if (access(path, F_OK))
+			return 0;
+
+		if (!realpath(path, l->dir)) {
+			pr_perror("Can't resolve %s", path);
+			return -1;
+		}
+
+		for (i = 0; i < c->nr_levels; i++)
+			if (!strcmp(c->levels[i].dir, l->dir)) {
+				pr_err("Parent chain of %s loops at %s\n", dir, l->dir);
+				return -1;
+			}
+	}
+
+	pr_err("Parent chain of %s is longer than %d\n", dir, PM_MAX_LEVELS);
+	return -1;
+}
+
+int pagemap_chain(char dir[], char out[])
+{
+	struct pm_chain *c;
+	json_t *js_pstree = NULL, *js = NULL, *levels, *procs, *entry;
+	char path[PATH_MAX];
+	FILE *f;
+	int i, pid, ret = -1;
+
+	c = mem_calloc(1, sizeof(*c));
+	if (!c) {
+		pr_err("Can't allocate pagemap chain\n");
+		return -1;
+	}
+	c->page_size = sysconf(_SC_PAGESIZE);
+
+	if (find_levels(c, dir))
+		goto out;
+
+	if (run_parallel(c->nr_levels, load_level, c))
+		goto out;
+
+	snprintf(path, sizeof(path), "%s/pstree.img", dir);
+	if (img_load_json(path, &js_pstree)) {
+		pr_err("Can't load %s\n", path);
+		goto out;
+	}
+
+	js = json_object();
+	levels = json_array();
+	procs = json_array();
+	if (!js || json_object_set_new(js, "levels", levels) ||
+	    json_object_set_new(js, "processes", procs)) {
+		pr_err("Can't allocate pagemap json\n");
+		goto out;
+	}
+
+	for (i = 0; (entry = img_json_entry(js_pstree, i)); i++) {
+		json_t *proc;
+
+		pid = json_integer_value(json_object_get(entry, "pid"));
+
+		proc = json_object();
+		if (!proc || json_array_append_new(procs, proc) ||
+		    json_object_set_new(proc, "pid", json_integer(pid)) ||
+		    json_object_set_new(proc, "vmas", json_array())) {
+			pr_err("Can't allocate process json\n");
+			goto out;
+		}
+
+		if (resolve_proc(c, pid, proc))
+			goto out;
+	}
+
+	for (i = 0; i < c->nr_levels; i++) {
+		json_t *level = json_object();
+
+		if (!level || json_array_append_new(levels, level) ||
+		    json_object_set_new(level, "dir", json_string(c->levels[i].dir)) ||
+		    json_object_set_new(level, "pages", json_integer(c->levels[i].pages)) ||
+		    json_object_set_new(level, "lazy", json_integer(c->levels[i].lazy))) {
+			pr_err("Can't allocate level json\n");
+			goto out;
+		}
+	}
+
+	if (json_object_set_new(js, "missing", json_integer(c->missing)))
+		goto out;
+
+	if (c->missing)
+		pr_err("%lu pages are missing in the parent chain of %s\n",
+		       c->missing, dir);
+
+	f = img_fopen(out, "w");
+	if (!f)
+		goto out;
+
+	ret = json_dumpf(js, f, JSON_INDENT(4));
+	if (fclose(f))
+		ret = -1;
+	if (ret)
+		pr_err("Can't dump json object\n");
+out:
+	if (js)
+		json_decref(js);
+	if (js_pstree)
+		json_decref(js_pstree);
+	for (i = 0; i < c->nr_levels; i++)
+		free_level(&c->levels[i]);
+	mem_free(c->runs);
+	mem_free(c);
+	return ret;
+}
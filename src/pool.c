@@ -0,0 +1,239 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mem.h"
+#include "pool.h"
+
+struct pool {
+	pool_fn_t	fn;
+	void		*arg;
+	int		nr_jobs;
+	int		next;
+	int		active;
+	int		failed;
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;
+};
+
+int nr_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+static void *worker(void *data)
+{
+	struct pool *p = data;
+	int idx;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->next < p->nr_jobs) {
+		/*
+		 * Close to the memory budget only one job is
+		 * allowed to run, the rest wait for it to finish.
+		 */
+		if (p->active && mem_pressure()) {
+			pthread_cond_wait(&p->done, &p->lock);
+			continue;
+		}
+
+		idx = p->next++;
+		p->active++;
+		pthread_mutex_unlock(&p->lock);
+
+		if (p->fn(p->arg, idx))
+			__sync_fetch_and_add(&p->failed, 1);
+
+		pthread_mutex_lock(&p->lock);
+		p->active--;
+		pthread_cond_broadcast(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+int run_parallel(int nr_jobs, pool_fn_t fn, void *arg)
+{
+	struct pool p = {
+		.fn	= fn,
+		.arg	= arg,
+		.nr_jobs = nr_jobs,
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.done	= PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t *threads;
+	int nr, i;
+
+	nr = nr_workers();
+	if (nr > nr_jobs)
+		nr = nr_jobs;
+	if (nr <= 1) {
+		worker(&p);
+		return p.failed ? -1 : 0;
+	}
+
+	threads = malloc(nr * sizeof(*threads));
+	if (!threads) {
+		pr_err("Can't allocate worker threads\n");
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&threads[i], NULL, worker, &p)) {
+			pr_err("Can't create worker thread\n");
+			break;
+		}
+	}
+
+	/* Whatever threads we managed to start will drain the queue */
+	if (i == 0)
+		worker(&p);
+	nr = i;
+
+	for (i = 0; i < nr; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	return p.failed ? -1 : 0;
+}
+
+struct wq_job {
+	void		*job;
+	struct wq_job	*next;
+};
+
+struct workqueue {
+	wq_fn_t		fn;
+	void		*arg;
+	struct wq_job	*head, **tail;
+	bool		stopping;
+	int		active;
+	int		failed;
+	int		nr_threads;
+	pthread_t	*threads;
+	pthread_mutex_t	lock;
+	pthread_cond_t	more;
+};
+
+static void *wq_worker(void *data)
+{
+	struct workqueue *wq = data;
+	struct wq_job *j;
+
+	pthread_mutex_lock(&wq->lock);
+	while (1) {
+		if (!wq->head) {
+			if (wq->stopping)
+				break;
+			pthread_cond_wait(&wq->more, &wq->lock);
+			continue;
+		}
+
+		/* Like in run_parallel(), one job at a time near the memory budget */
+		if (wq->active && mem_pressure()) {
+			pthread_cond_wait(&wq->more, &wq->lock);
+			continue;
+		}
+
+		j = wq->head;
+		wq->head = j->next;
+		if (!wq->head)
+			wq->tail = &wq->head;
+		wq->active++;
+		pthread_mutex_unlock(&wq->lock);
+
+		if (wq->fn(wq->arg, j->job))
+			__sync_fetch_and_add(&wq->failed, 1);
+		free(j);
+
+		pthread_mutex_lock(&wq->lock);
+		wq->active--;
+		pthread_cond_broadcast(&wq->more);
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+struct workqueue *wq_start(wq_fn_t fn, void *arg)
+{
+	struct workqueue *wq;
+	int i, nr = nr_workers();
+
+	wq = calloc(1, sizeof(*wq));
+	if (wq)
+		wq->threads = calloc(nr, sizeof(pthread_t));
+	if (!wq || !wq->threads) {
+		pr_err("Can't allocate workqueue\n");
+		free(wq);
+		return NULL;
+	}
+
+	wq->fn = fn;
+	wq->arg = arg;
+	wq->tail = &wq->head;
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->more, NULL);
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&wq->threads[i], NULL, wq_worker, wq))
+			break;
+		wq->nr_threads++;
+	}
+
+	if (!wq->nr_threads) {
+		pr_err("Can't create worker thread\n");
+		free(wq->threads);
+		free(wq);
+		return NULL;
+	}
+
+	return wq;
+}
+
+int wq_queue(struct workqueue *wq, void *job)
+{
+	struct wq_job *j;
+
+	j = malloc(sizeof(*j));
+	if (!j) {
+		pr_err("Can't allocate job\n");
+		return -1;
+	}
+
+	j->job = job;
+	j->next = NULL;
+
+	pthread_mutex_lock(&wq->lock);
+	*wq->tail = j;
+	wq->tail = &j->next;
+	pthread_cond_signal(&wq->more);
+	pthread_mutex_unlock(&wq->lock);
+
+	return 0;
+}
+
+int wq_stop(struct workqueue *wq)
+{
+	int i, ret;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stopping = true;
+	pthread_cond_broadcast(&wq->more);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nr_threads; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	ret = wq->failed ? -1 : 0;
+
+	free(wq->threads);
+	free(wq);
+	return ret;
+}
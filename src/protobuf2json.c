@@ -5,6 +5,8 @@
 
 #include "protobuf2json.h"
 #include "log.h"
+#include "mem.h"
+#include "intern.h"
 
 #ifndef json_boolean_value
 #define json_boolean_value(json) ((json) && json_typeof(json) == JSON_TRUE)
@@ -66,14 +68,14 @@ static int pb_field_to_json(const ProtobufCFieldDescriptor *fd, const void *pb_f
 			return -1;
 		}
 
-		*js_field = json_string((char *)pb_enum_val->name);
+		*js_field = json_string_interned(pb_enum_val->name);
 
 		break;
 		}
 	case PROTOBUF_C_TYPE_STRING:
 		pr_info("Type: string\n");
 
-		*js_field = json_string(*(char **)pb_field);
+		*js_field = json_string_interned(*(char **)pb_field);
 		break;
 	case PROTOBUF_C_TYPE_BYTES:
 		{
@@ -105,7 +107,7 @@ static int pb_field_to_json(const ProtobufCFieldDescriptor *fd, const void *pb_f
 	return 0;
 }
 
-static size_t get_size_of_pb_type(ProtobufCType type)
+size_t get_size_of_pb_type(ProtobufCType type)
 {
 	switch (type) {
 	case PROTOBUF_C_TYPE_INT32:
@@ -136,11 +138,32 @@ static size_t get_size_of_pb_type(ProtobufCType type)
 	}
 }
 
+bool pb_field_present(const ProtobufCFieldDescriptor *fd, const void *pb)
+{
+	const void *pb_field = pb + fd->offset;
+	const void *pb_quant = pb + fd->quantifier_offset;
+
+	switch (fd->label) {
+	case PROTOBUF_C_LABEL_REQUIRED:
+		return true;
+	case PROTOBUF_C_LABEL_OPTIONAL:
+		if (fd->type == PROTOBUF_C_TYPE_MESSAGE ||
+		    fd->type == PROTOBUF_C_TYPE_STRING)
+			return *(const void * const *)pb_field != NULL;
+		return *(const protobuf_c_boolean *)pb_quant;
+	case PROTOBUF_C_LABEL_REPEATED:
+		return *(const size_t *)pb_quant != 0;
+	}
+
+	return false;
+}
+
 int protobuf_to_json(const ProtobufCMessageDescriptor *pb_desc, const void *pb, json_t **js)
 {
-	int i, ret;
+	int i, ret, tag;
 	json_t *js_field = NULL;
 
+	tag = mem_tag("to-json", pb_desc->name);
 	*js = json_object();
 	if (!*js) {
 		pr_err("Can't allocate json object\n");
@@ -233,7 +256,8 @@ int protobuf_to_json(const ProtobufCMessageDescriptor *pb_desc, const void *pb,
 			goto err;
 
 		pr_info("Adding %s to json\n", fd->name);
-		ret = json_object_set_new(*js, fd->name, js_field);
+		/* descriptor names are plain ascii, no need to validate them */
+		ret = json_object_set_new_nocheck(*js, fd->name, js_field);
 		if (ret) {
 			pr_err("Can't add %s field to json message", fd->name);
 			goto err;
@@ -242,15 +266,251 @@ int protobuf_to_json(const ProtobufCMessageDescriptor *pb_desc, const void *pb,
 		pr_info("Done processing field %s\n", fd->name);
 	}
 
+	mem_untag(tag);
 	return 0;
 
 err:
 	if (*js)
 		json_decref(*js);
 
+	mem_untag(tag);
 	return -1;
 }
 
+/*
+ * Dump path. Integers, which are most of criu images (register sets,
+ * pstree ids, pagemap addresses), are formatted in place two digits at a
+ * time instead of becoming json_integer nodes one by one. Strings and
+ * reals still go through jansson for the very same escaping and precision.
+ */
+
+static const char dec_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* Same digits "%lld" gives, written backwards from end */
+static char *fmt_int(char *end, int64_t sval)
+{
+	uint64_t val = sval < 0 ? -(uint64_t)sval : sval;
+	char *p = end;
+
+	while (val >= 100) {
+		p -= 2;
+		memcpy(p, dec_pairs + (val % 100) * 2, 2);
+		val /= 100;
+	}
+
+	if (val >= 10) {
+		p -= 2;
+		memcpy(p, dec_pairs + val * 2, 2);
+	} else
+		*--p = '0' + val;
+
+	if (sval < 0)
+		*--p = '-';
+
+	return p;
+}
+
+static bool pb_type_is_int(ProtobufCType type)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_FIXED64:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Value as json_integer() of pb_field_to_json() would hold it */
+static bool pb_int_value(const ProtobufCFieldDescriptor *fd, const void *pb_field, int64_t *val)
+{
+	if (!pb_type_is_int(fd->type))
+		return false;
+
+	switch (fd->type) {
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+		*val = *(const int32_t *)pb_field;
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_FIXED32:
+		*val = *(const uint32_t *)pb_field;
+		break;
+	default:
+		*val = *(const int64_t *)pb_field;
+	}
+
+	return true;
+}
+
+/* Set for the thread dumping or loading a document with --string-dict */
+static __thread struct intern_dict *dump_dict;
+static __thread json_t *load_strings;
+
+void pb_dump_dict(struct intern_dict *dict)
+{
+	dump_dict = dict;
+}
+
+void pb_load_dict(json_t *strings)
+{
+	load_strings = strings;
+}
+
+void json_dump_indent(FILE *f, size_t flags, int depth, bool space)
+{
+	int n = (flags & JSON_MAX_INDENT) * depth;
+
+	if (flags & JSON_MAX_INDENT) {
+		fputc('\n', f);
+		while (n--)
+			fputc(' ', f);
+	} else if (space && !(flags & JSON_COMPACT))
+		fputc(' ', f);
+}
+
+static int dump_value(const ProtobufCFieldDescriptor *fd, const void *pb_field,
+		      FILE *f, size_t flags, int depth)
+{
+	json_t *js = NULL;
+	char buf[24], *p;
+	int64_t val;
+	int ret;
+
+	if (pb_int_value(fd, pb_field, &val)) {
+		p = fmt_int(buf + sizeof(buf), val);
+		fwrite(p, 1, buf + sizeof(buf) - p, f);
+		return 0;
+	}
+
+	if (fd->type == PROTOBUF_C_TYPE_BOOL) {
+		fputs(*(const protobuf_c_boolean *)pb_field ? "true" : "false", f);
+		return 0;
+	}
+
+	if (fd->type == PROTOBUF_C_TYPE_MESSAGE) {
+		const ProtobufCMessage *pb = *(const ProtobufCMessage * const *)pb_field;
+
+		return protobuf_dump_json(pb->descriptor, pb, f, flags, depth);
+	}
+
+	/* Enum names are C identifiers, nothing to escape */
+	if (fd->type == PROTOBUF_C_TYPE_ENUM) {
+		const ProtobufCEnumValue *pb_enum_val;
+
+		pb_enum_val = protobuf_c_enum_descriptor_get_value(fd->descriptor,
+								   *(const int *)pb_field);
+		if (!pb_enum_val) {
+			pr_err("Unknown enum value of field %s\n", fd->name);
+			return -1;
+		}
+		fprintf(f, "\"%s\"", pb_enum_val->name);
+		return 0;
+	}
+
+	if (fd->type == PROTOBUF_C_TYPE_STRING && dump_dict) {
+		int idx = intern_dict_add(dump_dict, *(char * const *)pb_field);
+
+		if (idx >= 0) {
+			p = fmt_int(buf + sizeof(buf), idx);
+			fwrite(p, 1, buf + sizeof(buf) - p, f);
+			return 0;
+		}
+	}
+
+	if (pb_field_to_json(fd, pb_field, &js))
+		return -1;
+
+	ret = json_dumpf(js, f, flags | JSON_ENCODE_ANY);
+	json_decref(js);
+	if (ret)
+		pr_err("Can't dump field %s\n", fd->name);
+
+	return ret;
+}
+
+static int dump_array(const ProtobufCFieldDescriptor *fd, const void *pb_field,
+		      size_t n_values, FILE *f, size_t flags, int depth)
+{
+	const void *values = *(const void * const *)pb_field;
+	size_t i, value_size;
+
+	value_size = get_size_of_pb_type(fd->type);
+	if (value_size == 0) {
+		pr_err("Unknown type of field %s\n", fd->name);
+		return -1;
+	}
+
+	fputc('[', f);
+	json_dump_indent(f, flags, depth + 1, false);
+
+	for (i = 0; i < n_values; i++) {
+		if (dump_value(fd, values + i * value_size, f, flags, depth + 1))
+			return -1;
+
+		if (i < n_values - 1) {
+			fputc(',', f);
+			json_dump_indent(f, flags, depth + 1, true);
+		} else
+			json_dump_indent(f, flags, depth, false);
+	}
+
+	fputc(']', f);
+	return 0;
+}
+
+int protobuf_dump_json(const ProtobufCMessageDescriptor *pb_desc, const void *pb,
+		       FILE *f, size_t flags, int depth)
+{
+	bool first = true;
+	int i, ret;
+
+	fputc('{', f);
+
+	for (i = 0; i < pb_desc->n_fields; i++) {
+		const ProtobufCFieldDescriptor *fd = pb_desc->fields + i;
+		const void *pb_field = pb + fd->offset;
+
+		if (!pb_field_present(fd, pb))
+			continue;
+
+		if (!first) {
+			fputc(',', f);
+			json_dump_indent(f, flags, depth + 1, true);
+		} else
+			json_dump_indent(f, flags, depth + 1, false);
+		first = false;
+
+		fprintf(f, "\"%s\"%s", fd->name, flags & JSON_COMPACT ? ":" : ": ");
+
+		if (fd->label == PROTOBUF_C_LABEL_REPEATED)
+			ret = dump_array(fd, pb_field, *(const size_t *)(pb + fd->quantifier_offset),
+					 f, flags, depth + 1);
+		else
+			ret = dump_value(fd, pb_field, f, flags, depth + 1);
+		if (ret)
+			return -1;
+	}
+
+	if (!first)
+		json_dump_indent(f, flags, depth, false);
+	fputc('}', f);
+
+	return ferror(f) ? -1 : 0;
+}
+
 static int js_field_to_pb(const ProtobufCFieldDescriptor *fd, json_t *js_field, void **pb_field)
 {
 	pr_info("Start converting field %s to pb\n", fd->name);
@@ -393,52 +653,70 @@ static int js_field_to_pb(const ProtobufCFieldDescriptor *fd, json_t *js_field,
 		}
 	case PROTOBUF_C_TYPE_STRING:
 		{
-		const char *val;
+		char *val;
 
 		pr_info("Type: string\n");
 
+		/* --string-dict documents refer to "strings" by index */
+		if (json_is_integer(js_field) && load_strings) {
+			js_field = json_array_get(load_strings, json_integer_value(js_field));
+			if (!js_field) {
+				pr_err("No such string in dictionary\n");
+				return -1;
+			}
+		}
+
 		if (!json_is_string(js_field)) {
 			pr_err("json object is not a string\n");
 			return -1;
 		}
 
-		val = json_string_value(js_field);
+		/*
+		 * pb owns its strings and frees them in free_unpacked,
+		 * so don't point into json.
+		 */
+		val = mem_strdup(json_string_value(js_field));
+		if (!val) {
+			pr_err("Can't allocate mem for string\n");
+			return -1;
+		}
+
 		memcpy(pb_field, &val, sizeof(val));
 		break;
 		}
 	case PROTOBUF_C_TYPE_BYTES:
 		{
-		ProtobufCBinaryData *bin;
+		ProtobufCBinaryData bin;
 
 		pr_info("Type: bytes\n");
 
-		bin = malloc(sizeof(*bin));
-		if (!bin) {
-			pr_err("Can't allocate mem for bin\n");
-			return -1;
-		}
-
 		if (!json_is_string(js_field)) {
 			pr_err("json object is not a string(bytes)\n");
 			return -1;
 		}
 
-		bin->data = (uint8_t *)json_string_value(js_field);
-		bin->len = sizeof(bin->data);
+		bin.data = (uint8_t *)mem_strdup(json_string_value(js_field));
+		if (!bin.data) {
+			pr_err("Can't allocate mem for bin\n");
+			return -1;
+		}
+		bin.len = strlen((char *)bin.data);
 
 		memcpy(pb_field, &bin, sizeof(bin));
 		break;
 		}
 	case PROTOBUF_C_TYPE_MESSAGE:
 		{
-		ProtobufCMessage *pb;
+		ProtobufCMessage *pb = NULL;
+		int ret;
 
 		pr_info("Type: message\n");
 
-		if(json_to_protobuf(fd->descriptor, js_field, (void **)&pb))
-			return -1;
-
+		/* Half converted message is still handed over, so it gets freed */
+		ret = json_to_protobuf(fd->descriptor, js_field, (void **)&pb);
 		memcpy(pb_field, &pb, sizeof(pb));
+		if (ret)
+			return -1;
 		break;
 		}
 	default:
@@ -451,9 +729,36 @@ static int js_field_to_pb(const ProtobufCFieldDescriptor *fd, json_t *js_field,
 	return 0;
 }
 
+/*
+ * Fills integer array the way js_field_to_pb() stores them, without its
+ * per element dispatch and logging. Unlike the dump side this does not save
+ * json nodes: to-img still loads the whole document into a jansson tree.
+ */
+static int js_ints_to_pb(const ProtobufCFieldDescriptor *fd, json_t *js_array,
+			 void *pb_array, size_t value_size)
+{
+	size_t i, n = json_array_size(js_array);
+
+	for (i = 0; i < n; i++) {
+		json_t *value = json_array_get(js_array, i);
+
+		if (!json_is_integer(value)) {
+			pr_err("json object is not an integer\n");
+			return -1;
+		}
+
+		if (value_size == sizeof(uint32_t))
+			((uint32_t *)pb_array)[i] = json_integer_value(value);
+		else
+			((uint64_t *)pb_array)[i] = json_integer_value(value);
+	}
+
+	return 0;
+}
+
 int json_to_protobuf(const ProtobufCMessageDescriptor *pb_desc, json_t *js, void **pb)
 {
-	int ret = 0;
+	int ret = 0, tag;
 
 	const char *js_key;
 	json_t *js_val;
@@ -461,12 +766,15 @@ int json_to_protobuf(const ProtobufCMessageDescriptor *pb_desc, json_t *js, void
 	void *pb_field;
 	void *pb_quant;
 
+	*pb = NULL;
+	tag = mem_tag("to-pb", pb_desc->name);
+
 	if (!json_is_object(js)) {
 		pr_err("Not a json object\n");
 		goto err;
 	}
 
-	*pb = malloc(pb_desc->sizeof_message);
+	*pb = mem_alloc(pb_desc->sizeof_message);
 	if (!*pb) {
 		pr_err("Can't allocate memory for pb\n");
 		goto err;
@@ -525,8 +833,7 @@ int json_to_protobuf(const ProtobufCMessageDescriptor *pb_desc, json_t *js, void
 			}
 
 			n_values = (size_t *)pb_quant;
-			*n_values = json_array_size(js_val);
-			if (!*n_values)
+			if (!json_array_size(js_val))
 				break;
 
 			value_size = get_size_of_pb_type(fd->type);
@@ -535,22 +842,37 @@ int json_to_protobuf(const ProtobufCMessageDescriptor *pb_desc, json_t *js, void
 				goto err;
 			}
 
-			pb_array = malloc(*n_values * value_size);
+			pb_array = mem_alloc(json_array_size(js_val) * value_size);
 			if (!pb_array) {
 				pr_err("Can't alloc array for field %s\n", fd->name);
 				goto err;
 			}
 
+			/*
+			 * Keep the message safe to free_unpacked at any point:
+			 * array is zeroed and only filled values are counted.
+			 */
+			memset(pb_array, 0, json_array_size(js_val) * value_size);
+			memcpy(pb_field, &pb_array, sizeof(pb_array));
+
+			if (pb_type_is_int(fd->type)) {
+				*n_values = json_array_size(js_val);
+				ret = js_ints_to_pb(fd, js_val, pb_array, value_size);
+				break;
+			}
+
 			json_array_foreach(js_val, index, value) {
 				pb_array_val = pb_array + index * value_size;
 
 				ret = js_field_to_pb(fd, value, pb_array_val);
+				/* half converted messages are handed over too */
+				if (!ret || (fd->type == PROTOBUF_C_TYPE_MESSAGE &&
+					     *(void **)pb_array_val))
+					*n_values = index + 1;
 				if (ret)
 					goto err;
 			}
 
-			memcpy(pb_field, &pb_array, sizeof(pb_array));
-
 			break;
 			}
 		default:
@@ -564,7 +886,9 @@ int json_to_protobuf(const ProtobufCMessageDescriptor *pb_desc, json_t *js, void
 		pr_info("Done processing field %s\n", js_key);
 	}
 
+	mem_untag(tag);
 	return 0;
 err:
+	mem_untag(tag);
 	return -1;
 }
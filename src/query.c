@@ -0,0 +1,967 @@
+#define _GNU_SOURCE
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "log.h"
+#include "protobuf2json.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "pool.h"
+#include "query.h"
+
+/*
+ * query 'MESSAGE [where COND]' SRC prints every MESSAGE entry of SRC
+ * image or dump directory matching COND as a json line
+ *
+ *	{"image": "inetsk.img", "index": 3, "entry": {...}}
+ *
+ * COND is made of FIELD OP VALUE terms joined with and, or, not and
+ * parentheses. FIELD may be a dotted path into nested messages, OP is one
+ * of == != < <= > >= & (all bits set) ^= (prefix) *= (substring). VALUE
+ * is a number, "string", true/false or an enum value name. A term holds
+ * if any value of a repeated field matches, absent fields never match.
+ *
+ * Terms are compiled against the descriptor and evaluated straight on
+ * the packed entry, decoding only the fields they refer to. Only matching
+ * entries are unpacked.
+ *
+ * filter QUERY SRC DEST copies SRC image to DEST keeping only MESSAGE
+ * entries matching COND. It works on streams, and entries it doesn't need
+ * to look at are forwarded with splice() without being read at all.
+ */
+
+#define QUERY_MAX_DEPTH	8
+
+enum {
+	Q_ALL,
+	Q_AND,
+	Q_OR,
+	Q_NOT,
+	Q_EQ,
+	Q_NE,
+	Q_LT,
+	Q_LE,
+	Q_GT,
+	Q_GE,
+	Q_MASK,
+	Q_PREFIX,
+	Q_CONTAINS,
+};
+
+enum {
+	QV_INT,
+	QV_UINT,
+	QV_DOUBLE,
+	QV_STR,
+};
+
+struct qval {
+	int		kind;
+	int64_t		i;
+	uint64_t	u;
+	double		d;
+	const char	*s;
+	size_t		len;
+};
+
+struct qnode {
+	int				op;
+	struct qnode			*l, *r;
+
+	const ProtobufCFieldDescriptor	*path[QUERY_MAX_DEPTH];
+	int				depth;
+	struct qval			val;
+};
+
+struct query {
+	const ProtobufCMessageDescriptor	*desc;
+	struct qnode				*root;
+	char					**paths;
+	/* images with unknown magic are skipped in dump directories */
+	bool					skip_unknown;
+	unsigned long				nr_matches;
+};
+
+/* Tokenizer */
+
+struct qparser {
+	const char				*p;
+	char					tok[256];
+	bool					quoted;
+	const ProtobufCMessageDescriptor	*desc;
+};
+
+static int next_token(struct qparser *qp)
+{
+	const char *start;
+	size_t len;
+
+	while (isspace(*qp->p))
+		qp->p++;
+
+	qp->quoted = false;
+	start = qp->p;
+
+	if (*qp->p == '\0') {
+		qp->tok[0] = '\0';
+		return 0;
+	}
+
+	if (*qp->p == '"') {
+		start = ++qp->p;
+		while (*qp->p && *qp->p != '"')
+			qp->p++;
+		if (*qp->p != '"') {
+			pr_err("Unterminated string in query\n");
+			return -1;
+		}
+		len = qp->p++ - start;
+		qp->quoted = true;
+	} else if (isalnum(*qp->p) || *qp->p == '_' || *qp->p == '-') {
+		while (isalnum(*qp->p) || *qp->p == '_' || *qp->p == '.' || *qp->p == '-')
+			qp->p++;
+		len = qp->p - start;
+	} else if (strchr("=!<>^*", *qp->p) && qp->p[1] == '=') {
+		qp->p += 2;
+		len = 2;
+	} else {
+		qp->p++;
+		len = 1;
+	}
+
+	if (len >= sizeof(qp->tok)) {
+		pr_err("Too long token in query\n");
+		return -1;
+	}
+
+	memcpy(qp->tok, start, len);
+	qp->tok[len] = '\0';
+	return 0;
+}
+
+static bool token_is(struct qparser *qp, const char *str)
+{
+	return !qp->quoted && !strcmp(qp->tok, str);
+}
+
+/* Parser */
+
+static struct qnode *new_node(int op, struct qnode *l, struct qnode *r)
+{
+	struct qnode *n;
+
+	n = mem_calloc(1, sizeof(*n));
+	if (!n) {
+		pr_err("Can't allocate query node\n");
+		return NULL;
+	}
+
+	n->op = op;
+	n->l = l;
+	n->r = r;
+	return n;
+}
+
+static void free_node(struct qnode *n)
+{
+	if (!n)
+		return;
+
+	free_node(n->l);
+	free_node(n->r);
+	mem_free((void *)n->val.s);
+	mem_free(n);
+}
+
+static int resolve_path(struct qnode *n, const ProtobufCMessageDescriptor *desc,
+			const char *path)
+{
+	char name[256], *tok, *save;
+
+	snprintf(name, sizeof(name), "%s", path);
+
+	for (tok = strtok_r(name, ".", &save); tok; tok = strtok_r(NULL, ".", &save)) {
+		const ProtobufCFieldDescriptor *fd;
+
+		if (!desc) {
+			pr_err("%s is not a message field\n", n->path[n->depth - 1]->name);
+			return -1;
+		}
+
+		if (n->depth == QUERY_MAX_DEPTH) {
+			pr_err("Too deep field path %s\n", path);
+			return -1;
+		}
+
+		fd = protobuf_c_message_descriptor_get_field_by_name(desc, tok);
+		if (!fd) {
+			pr_err("No field %s in %s\n", tok, desc->name);
+			return -1;
+		}
+
+		n->path[n->depth++] = fd;
+		desc = fd->type == PROTOBUF_C_TYPE_MESSAGE ? fd->descriptor : NULL;
+	}
+
+	if (desc) {
+		pr_err("Can't compare message %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_value(struct qnode *n, struct qparser *qp)
+{
+	const ProtobufCFieldDescriptor *fd = n->path[n->depth - 1];
+	struct qval *v = &n->val;
+	char *end = NULL;
+
+	switch (fd->type) {
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_BYTES:
+		if (!qp->quoted)
+			goto bad;
+		v->kind = QV_STR;
+		v->s = mem_strdup(qp->tok);
+		v->len = strlen(qp->tok);
+		return v->s ? 0 : -1;
+	case PROTOBUF_C_TYPE_FLOAT:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		v->kind = QV_DOUBLE;
+		v->d = strtod(qp->tok, &end);
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		v->kind = QV_INT;
+		if (token_is(qp, "true") || token_is(qp, "false")) {
+			v->i = token_is(qp, "true");
+			return 0;
+		}
+		v->i = strtoll(qp->tok, &end, 0);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+		{
+		const ProtobufCEnumValue *val_enum;
+
+		v->kind = QV_INT;
+		val_enum = protobuf_c_enum_descriptor_get_value_by_name(fd->descriptor, qp->tok);
+		if (val_enum) {
+			v->i = val_enum->value;
+			return 0;
+		}
+		v->i = strtoll(qp->tok, &end, 0);
+		break;
+		}
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_FIXED64:
+		v->kind = QV_UINT;
+		if (qp->tok[0] == '-')
+			goto bad;
+		v->u = strtoull(qp->tok, &end, 0);
+		break;
+	default:
+		v->kind = QV_INT;
+		v->i = strtoll(qp->tok, &end, 0);
+		break;
+	}
+
+	if (qp->quoted || end == qp->tok || *end != '\0')
+		goto bad;
+
+	if (v->kind == QV_INT)
+		v->u = v->i;
+	return 0;
+bad:
+	pr_err("Bad value %s for field %s\n", qp->tok, fd->name);
+	return -1;
+}
+
+static struct qnode *parse_or(struct qparser *qp);
+
+static struct qnode *parse_term(struct qparser *qp)
+{
+	static const struct {
+		const char	*tok;
+		int		op;
+	} ops[] = {
+		{ "==", Q_EQ }, { "!=", Q_NE }, { "<", Q_LT }, { "<=", Q_LE },
+		{ ">", Q_GT }, { ">=", Q_GE }, { "&", Q_MASK },
+		{ "^=", Q_PREFIX }, { "*=", Q_CONTAINS },
+	};
+	struct qnode *n, *q;
+	char field[256];
+	int i;
+
+	if (token_is(qp, "not")) {
+		if (next_token(qp))
+			return NULL;
+		n = parse_term(qp);
+		if (!n)
+			return NULL;
+		q = new_node(Q_NOT, n, NULL);
+		if (!q)
+			free_node(n);
+		return q;
+	}
+
+	if (token_is(qp, "(")) {
+		if (next_token(qp))
+			return NULL;
+		n = parse_or(qp);
+		if (!n)
+			return NULL;
+		if (!token_is(qp, ")")) {
+			pr_err("Missing ) in query\n");
+			free_node(n);
+			return NULL;
+		}
+		if (next_token(qp)) {
+			free_node(n);
+			return NULL;
+		}
+		return n;
+	}
+
+	if (qp->quoted || !qp->tok[0]) {
+		pr_err("Field name expected in query, got %s\n", qp->tok);
+		return NULL;
+	}
+	snprintf(field, sizeof(field), "%s", qp->tok);
+
+	if (next_token(qp))
+		return NULL;
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		if (token_is(qp, ops[i].tok))
+			break;
+
+	if (i == sizeof(ops) / sizeof(ops[0])) {
+		pr_err("Unknown operator %s in query\n", qp->tok);
+		return NULL;
+	}
+
+	n = new_node(ops[i].op, NULL, NULL);
+	if (!n)
+		return NULL;
+
+	if (resolve_path(n, qp->desc, field) ||
+	    next_token(qp) ||
+	    parse_value(n, qp) ||
+	    next_token(qp))
+		goto err;
+
+	if ((n->op == Q_PREFIX || n->op == Q_CONTAINS) && n->val.kind != QV_STR) {
+		pr_err("%s works on strings only\n", ops[i].tok);
+		goto err;
+	}
+
+	if (n->op == Q_MASK && n->val.kind != QV_UINT && n->val.kind != QV_INT) {
+		pr_err("& works on integers only\n");
+		goto err;
+	}
+
+	return n;
+err:
+	free_node(n);
+	return NULL;
+}
+
+static struct qnode *parse_and(struct qparser *qp)
+{
+	struct qnode *l, *r, *n;
+
+	l = parse_term(qp);
+	while (l && token_is(qp, "and")) {
+		if (next_token(qp) || !(r = parse_term(qp))) {
+			free_node(l);
+			return NULL;
+		}
+		n = new_node(Q_AND, l, r);
+		if (!n) {
+			free_node(l);
+			free_node(r);
+			return NULL;
+		}
+		l = n;
+	}
+
+	return l;
+}
+
+static struct qnode *parse_or(struct qparser *qp)
+{
+	struct qnode *l, *r, *n;
+
+	l = parse_and(qp);
+	while (l && token_is(qp, "or")) {
+		if (next_token(qp) || !(r = parse_and(qp))) {
+			free_node(l);
+			return NULL;
+		}
+		n = new_node(Q_OR, l, r);
+		if (!n) {
+			free_node(l);
+			free_node(r);
+			return NULL;
+		}
+		l = n;
+	}
+
+	return l;
+}
+
+static int compile_query(struct query *q, const char *expr)
+{
+	struct qparser qp = { .p = expr };
+
+	if (next_token(&qp))
+		return -1;
+
+	q->desc = find_msg_desc(qp.tok);
+	if (!q->desc) {
+		pr_err("Unknown message %s\n", qp.tok);
+		return -1;
+	}
+	qp.desc = q->desc;
+
+	if (next_token(&qp))
+		return -1;
+
+	if (!qp.tok[0]) {
+		q->root = new_node(Q_ALL, NULL, NULL);
+		return q->root ? 0 : -1;
+	}
+
+	if (!token_is(&qp, "where")) {
+		pr_err("where expected in query, got %s\n", qp.tok);
+		return -1;
+	}
+
+	if (next_token(&qp))
+		return -1;
+
+	q->root = parse_or(&qp);
+	if (!q->root)
+		return -1;
+
+	if (qp.tok[0]) {
+		pr_err("Unexpected %s in query\n", qp.tok);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Evaluation on packed protobuf */
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *val)
+{
+	int shift;
+
+	for (*val = 0, shift = 0; *p < end && shift < 64; shift += 7) {
+		uint8_t byte = *(*p)++;
+
+		*val |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static bool get_fixed(const uint8_t **p, const uint8_t *end, int n, uint64_t *val)
+{
+	int i;
+
+	if (end - *p < n)
+		return false;
+
+	/* protobuf fixed values are little endian */
+	for (*val = 0, i = 0; i < n; i++)
+		*val |= (uint64_t)(*p)[i] << (8 * i);
+	*p += n;
+
+	return true;
+}
+
+static bool skip_field(const uint8_t **p, const uint8_t *end, int wire_type)
+{
+	uint64_t val;
+
+	switch (wire_type) {
+	case 0:
+		return get_varint(p, end, &val);
+	case 1:
+		return get_fixed(p, end, 8, &val);
+	case 2:
+		if (!get_varint(p, end, &val) || val > end - *p)
+			return false;
+		*p += val;
+		return true;
+	case 5:
+		return get_fixed(p, end, 4, &val);
+	}
+
+	return false;
+}
+
+static bool get_value(const ProtobufCFieldDescriptor *fd, const uint8_t **p,
+		      const uint8_t *end, struct qval *v)
+{
+	uint64_t raw;
+
+	switch (fd->type) {
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_ENUM:
+		if (!get_varint(p, end, &raw))
+			return false;
+		v->kind = QV_INT;
+		v->i = (int32_t)raw;
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_BOOL:
+		if (!get_varint(p, end, &raw))
+			return false;
+		v->kind = QV_INT;
+		v->i = (int64_t)raw;
+		break;
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_SINT64:
+		if (!get_varint(p, end, &raw))
+			return false;
+		v->kind = QV_INT;
+		v->i = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_UINT64:
+		if (!get_varint(p, end, &raw))
+			return false;
+		v->kind = QV_UINT;
+		v->u = fd->type == PROTOBUF_C_TYPE_UINT32 ? (uint32_t)raw : raw;
+		break;
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FIXED64:
+		if (!get_fixed(p, end, fd->type == PROTOBUF_C_TYPE_FIXED32 ? 4 : 8, &raw))
+			return false;
+		v->kind = QV_UINT;
+		v->u = raw;
+		break;
+	case PROTOBUF_C_TYPE_SFIXED32:
+		if (!get_fixed(p, end, 4, &raw))
+			return false;
+		v->kind = QV_INT;
+		v->i = (int32_t)raw;
+		break;
+	case PROTOBUF_C_TYPE_SFIXED64:
+		if (!get_fixed(p, end, 8, &raw))
+			return false;
+		v->kind = QV_INT;
+		v->i = (int64_t)raw;
+		break;
+	case PROTOBUF_C_TYPE_FLOAT:
+		{
+		uint32_t raw32;
+		float f;
+
+		if (!get_fixed(p, end, 4, &raw))
+			return false;
+		raw32 = raw;
+		memcpy(&f, &raw32, sizeof(f));
+		v->kind = QV_DOUBLE;
+		v->d = f;
+		break;
+		}
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (!get_fixed(p, end, 8, &raw))
+			return false;
+		v->kind = QV_DOUBLE;
+		memcpy(&v->d, &raw, sizeof(v->d));
+		break;
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_BYTES:
+		if (!get_varint(p, end, &raw) || raw > end - *p)
+			return false;
+		v->kind = QV_STR;
+		v->s = (const char *)*p;
+		v->len = raw;
+		*p += raw;
+		break;
+	default:
+		return false;
+	}
+
+	if (v->kind == QV_INT)
+		v->u = v->i;
+	return true;
+}
+
+static int compare(struct qval *a, struct qval *b)
+{
+	int ret;
+
+	switch (b->kind) {
+	case QV_INT:
+		return a->i < b->i ? -1 : a->i > b->i;
+	case QV_UINT:
+		return a->u < b->u ? -1 : a->u > b->u;
+	case QV_DOUBLE:
+		return a->d < b->d ? -1 : a->d > b->d;
+	}
+
+	/* Strings are ordered lexicographically, a prefix goes first */
+	ret = memcmp(a->s, b->s, a->len < b->len ? a->len : b->len);
+	if (ret)
+		return ret;
+	return a->len < b->len ? -1 : a->len > b->len;
+}
+
+static bool match(struct qnode *n, struct qval *v)
+{
+	switch (n->op) {
+	case Q_EQ:
+		return compare(v, &n->val) == 0;
+	case Q_NE:
+		return compare(v, &n->val) != 0;
+	case Q_LT:
+		return compare(v, &n->val) < 0;
+	case Q_LE:
+		return compare(v, &n->val) <= 0;
+	case Q_GT:
+		return compare(v, &n->val) > 0;
+	case Q_GE:
+		return compare(v, &n->val) >= 0;
+	case Q_MASK:
+		return (v->u & n->val.u) == n->val.u;
+	case Q_PREFIX:
+		return v->len >= n->val.len && !memcmp(v->s, n->val.s, n->val.len);
+	case Q_CONTAINS:
+		return memmem(v->s, v->len, n->val.s, n->val.len) != NULL;
+	}
+
+	return false;
+}
+
+static bool is_packable(const ProtobufCFieldDescriptor *fd)
+{
+	return fd->type != PROTOBUF_C_TYPE_STRING &&
+	       fd->type != PROTOBUF_C_TYPE_BYTES &&
+	       fd->type != PROTOBUF_C_TYPE_MESSAGE;
+}
+
+/* Walk packed message looking for values of n->path[d] */
+static bool scan(struct qnode *n, int d, const uint8_t *p, const uint8_t *end)
+{
+	const ProtobufCFieldDescriptor *fd = n->path[d];
+	struct qval v;
+	uint64_t tag;
+
+	while (p < end) {
+		int wire_type;
+
+		if (!get_varint(&p, end, &tag))
+			return false;
+
+		wire_type = tag & 7;
+
+		if ((tag >> 3) != fd->id) {
+			if (!skip_field(&p, end, wire_type))
+				return false;
+			continue;
+		}
+
+		if (d < n->depth - 1 || (wire_type == 2 && is_packable(fd))) {
+			uint64_t len;
+
+			if (wire_type != 2 || !get_varint(&p, end, &len) || len > end - p)
+				return false;
+
+			if (d < n->depth - 1) {
+				if (scan(n, d + 1, p, p + len))
+					return true;
+			} else {
+				const uint8_t *vp = p;
+
+				/* packed repeated scalars */
+				while (vp < p + len)
+					if (!get_value(fd, &vp, p + len, &v))
+						return false;
+					else if (match(n, &v))
+						return true;
+			}
+
+			p += len;
+			continue;
+		}
+
+		if (!get_value(fd, &p, end, &v))
+			return false;
+		if (match(n, &v))
+			return true;
+	}
+
+	return false;
+}
+
+static bool eval(struct qnode *n, const uint8_t *buf, size_t len)
+{
+	switch (n->op) {
+	case Q_ALL:
+		return true;
+	case Q_AND:
+		return eval(n->l, buf, len) && eval(n->r, buf, len);
+	case Q_OR:
+		return eval(n->l, buf, len) || eval(n->r, buf, len);
+	case Q_NOT:
+		return !eval(n->l, buf, len);
+	}
+
+	return scan(n, 0, buf, buf + len);
+}
+
+static int print_match(const char *path, int idx, struct protobuf_info *pb_info,
+		       void *buf, int size)
+{
+	json_t *js, *js_entry = NULL;
+	const char *name;
+	void *obj;
+	int ret = -1;
+
+	obj = pb_info->unpack(&pb_allocator, size, buf);
+	if (!obj) {
+		pr_err("%s: can't unpack entry #%d\n", path, idx);
+		return -1;
+	}
+
+	if (protobuf_to_json(pb_info->desc, obj, &js_entry)) {
+		pr_err("%s: can't convert entry #%d to json\n", path, idx);
+		goto out;
+	}
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	js = json_object();
+	if (!js ||
+	    json_object_set_new(js, "image", json_string(name)) ||
+	    json_object_set_new(js, "index", json_integer(idx)) ||
+	    json_object_set_new(js, "entry", js_entry)) {
+		pr_err("Can't build match json\n");
+		json_decref(js);
+		goto out;
+	}
+
+	flockfile(stdout);
+	ret = json_dumpf(js, stdout, JSON_COMPACT);
+	putchar('\n');
+	funlockfile(stdout);
+
+	json_decref(js);
+out:
+	pb_info->free(obj, &pb_allocator);
+	return ret;
+}
+
+static int query_img(void *arg, int idx)
+{
+	struct query *q = arg;
+	const char *path = q->paths[idx];
+	struct criu_image_info *info;
+	uint32_t magic;
+	int fd, i, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	if (read(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_perror("Can't read magic from %s", path);
+		goto out;
+	}
+
+	info = find_img_info(magic);
+	if (!info && q->skip_unknown) {
+		pr_info("Skipping %s with unknown magic\n", path);
+		ret = 0;
+		goto out;
+	} else if (!info) {
+		pr_err("%s: unknown magic\n", path);
+		goto out;
+	}
+
+	if (info->header_info.desc != q->desc &&
+	    (!info->is_array || info->extra_info.desc != q->desc)) {
+		ret = 0;
+		goto out;
+	}
+
+	for (i = 0; ; i++) {
+		struct protobuf_info *pb_info;
+		void *buf;
+		int size;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (info->is_array)
+			pb_info = &info->extra_info;
+		else
+			break;
+
+		ret = read_pb_buf(fd, &buf, &size);
+		if (ret < 0)
+			goto out;
+		else if (ret == 0)
+			break;
+
+		ret = 0;
+		if (pb_info->desc == q->desc && eval(q->root, buf, size)) {
+			__sync_fetch_and_add(&q->nr_matches, 1);
+			ret = print_match(path, i, pb_info, buf, size);
+		}
+
+		mem_free(buf);
+		if (ret)
+			goto out;
+	}
+
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+int query_imgs(char expr[], char src[])
+{
+	struct query q = {};
+	int n, ret = -1;
+
+	if (compile_query(&q, expr))
+		goto out;
+
+	n = img_list(src, &q.paths);
+	if (n < 0)
+		goto out;
+
+	q.skip_unknown = img_is_dir(src);
+	ret = run_parallel(n, query_img, &q);
+	pr_info("%lu entries matched\n", q.nr_matches);
+
+	img_list_free(q.paths, n);
+out:
+	free_node(q.root);
+	return ret;
+}
+
+int filter_img(char expr[], char in[], char out[])
+{
+	struct criu_image_info *info;
+	struct query q = {};
+	int fd_in = -1, fd_out = -1, i, ret = -1;
+	uint32_t magic;
+
+	if (compile_query(&q, expr))
+		goto out;
+
+	fd_in = img_open(in, O_RDONLY);
+	if (fd_in < 0)
+		goto out;
+
+	fd_out = img_open(out, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd_out < 0)
+		goto out;
+
+	if (read_all(fd_in, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_err("Can't read magic from %s\n", in);
+		goto out;
+	}
+
+	info = find_img_info(magic);
+	if (!info) {
+		pr_err("%s: unknown magic\n", in);
+		goto out;
+	}
+
+	if (write_all(fd_out, &magic, sizeof(magic)))
+		goto out;
+
+	for (i = 0; ; i++) {
+		struct protobuf_info *pb_info;
+		void *buf;
+		int size;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (info->is_array)
+			pb_info = &info->extra_info;
+		else
+			break;
+
+		/* Nothing left to filter, the rest goes through as is */
+		if (q.root->op == Q_ALL ||
+		    (pb_info->desc != q.desc &&
+		     (!info->is_array || info->extra_info.desc != q.desc))) {
+			ret = img_splice(fd_in, fd_out, -1);
+			goto out;
+		}
+
+		if (pb_info->desc != q.desc) {
+			ssize_t len = read_all(fd_in, &size, sizeof(size));
+
+			/* Image with no entries at all */
+			if (len == 0)
+				break;
+			if (len != sizeof(size)) {
+				pr_err("Can't read size of entry #%d\n", i);
+				goto out;
+			}
+			/* img_splice() would take a negative size for "up to EOF" */
+			if (size < 0) {
+				pr_err("Corrupt image, entry #%d size %d\n", i, size);
+				goto out;
+			}
+			if (write_all(fd_out, &size, sizeof(size)) ||
+			    img_splice(fd_in, fd_out, size))
+				goto out;
+			continue;
+		}
+
+		ret = read_pb_buf(fd_in, &buf, &size);
+		if (ret < 0)
+			goto out;
+		else if (ret == 0)
+			break;
+
+		ret = 0;
+		if (eval(q.root, buf, size)) {
+			q.nr_matches++;
+			ret = write_all(fd_out, &size, sizeof(size)) ||
+			      write_all(fd_out, buf, size);
+		}
+
+		mem_free(buf);
+		if (ret) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	pr_info("%lu entries kept\n", q.nr_matches);
+	ret = 0;
+out:
+	if (fd_out >= 0)
+		close(fd_out);
+	if (fd_in >= 0)
+		close(fd_in);
+	free_node(q.root);
+	return ret;
+}
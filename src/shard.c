@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <linux/limits.h>
+
+#include "log.h"
+#include "protobuf2json.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "pool.h"
+#include "crc32c.h"
+#include "shard.h"
+
+/*
+ * to-json --shard-size SIZE splits entries of an array image into DEST.0,
+ * DEST.1, ... files holding about SIZE bytes of packed entries each
+ *
+ *	{"magic": M, "version": 2, "first": I, "entries": [...]}
+ *
+ * and writes DEST manifest
+ *
+ *	{"magic": M, "version": 2, "header": {...}, "entries": N,
+ *	 "shards": [{"file": F, "first": I, "count": N, "size": B,
+ *		     "crc32c": C}, ...]}
+ *
+ * File names are relative to the manifest, first is the index of the
+ * first entry of the shard in "entries" numbering, size and crc32c are
+ * of the shard file. Shards are converted nr_workers() at a time and
+ * written out as they are dumped, so memory use stays around that many
+ * SIZEs of packed entries.
+ *
+ * to-img of a manifest checks the shards, packs them in parallel and
+ * writes them out in order after the header.
+ */
+
+#define SHARD_FLAGS	JSON_INDENT(4)
+
+struct shard {
+	char			path[PATH_MAX];
+	struct protobuf_info	*pb_info;
+	uint32_t		magic;
+	int			first;
+	int			count;
+
+	/* size prefixed packed entries */
+	void			*buf;
+	size_t			len;
+	size_t			alloc;
+
+	/* shard file, its size and crc32c */
+	int			fd;
+	uint32_t		crc;
+	size_t			size;
+};
+
+static int shard_reserve(struct shard *s, size_t len)
+{
+	size_t alloc = s->alloc ? s->alloc : 1 << 16;
+	void *buf;
+
+	if (s->len + len <= s->alloc)
+		return 0;
+
+	while (alloc < s->len + len)
+		alloc *= 2;
+
+	buf = mem_alloc(alloc);
+	if (!buf) {
+		pr_err("Can't allocate shard buffer\n");
+		return -1;
+	}
+
+	if (s->buf)
+		memcpy(buf, s->buf, s->len);
+	mem_free(s->buf);
+	s->buf = buf;
+	s->alloc = alloc;
+	return 0;
+}
+
+static void shard_reset(struct shard *s)
+{
+	mem_free(s->buf);
+	s->buf = NULL;
+	s->len = s->alloc = 0;
+}
+
+/* Reads raw entries up to shard_size bytes, returns their number */
+static int shard_read(int fd, struct shard *s, size_t shard_size)
+{
+	int pb_size;
+	ssize_t ret;
+
+	while (s->len < shard_size) {
+		ret = read_all(fd, &pb_size, sizeof(pb_size));
+		if (ret == 0)
+			break;
+		if (ret != sizeof(pb_size) || pb_size < 0) {
+			pr_err("Can't read size of entry #%d\n", s->first + s->count);
+			return -1;
+		}
+
+		if (shard_reserve(s, sizeof(pb_size) + pb_size))
+			return -1;
+
+		memcpy(s->buf + s->len, &pb_size, sizeof(pb_size));
+		if (read_all(fd, s->buf + s->len + sizeof(pb_size), pb_size) != pb_size) {
+			pr_err("Can't read entry #%d\n", s->first + s->count);
+			return -1;
+		}
+
+		s->len += sizeof(pb_size) + pb_size;
+		s->count++;
+	}
+
+	return s->count;
+}
+
+/* Shards are written out as they are dumped, checksumming on the way */
+static ssize_t shard_write(void *cookie, const char *buf, size_t len)
+{
+	struct shard *s = cookie;
+
+	if (write_all(s->fd, buf, len))
+		return -1;
+
+	s->crc = crc32c_update(s->crc, buf, len);
+	s->size += len;
+	return len;
+}
+
+static int shard_close(void *cookie)
+{
+	struct shard *s = cookie;
+
+	return close(s->fd);
+}
+
+static cookie_io_functions_t shard_io = {
+	.write	= shard_write,
+	.close	= shard_close,
+};
+
+static int shard_to_json(void *arg, int idx)
+{
+	struct shard *s = (struct shard *)arg + idx;
+	size_t off;
+	int pb_size, i, tag, ret = -1;
+	FILE *f;
+
+	s->fd = img_open(s->path, O_WRONLY | O_CREAT | O_TRUNC);
+	if (s->fd < 0)
+		return -1;
+
+	s->crc = 0;
+	s->size = 0;
+
+	f = fopencookie(s, "w", shard_io);
+	if (!f) {
+		pr_perror("Can't open shard %s", s->path);
+		close(s->fd);
+		return -1;
+	}
+
+	tag = mem_tag("to-json", s->pb_info->desc->name);
+
+	fputc('{', f);
+	json_dump_indent(f, SHARD_FLAGS, 1, false);
+	fprintf(f, "\"magic\": %u,", s->magic);
+	json_dump_indent(f, SHARD_FLAGS, 1, true);
+	fprintf(f, "\"version\": %d,", IMG_JSON_VERSION);
+	json_dump_indent(f, SHARD_FLAGS, 1, true);
+	fprintf(f, "\"first\": %d,", s->first);
+	json_dump_indent(f, SHARD_FLAGS, 1, true);
+	fputs("\"entries\": [", f);
+
+	for (i = 0, off = 0; i < s->count; i++) {
+		void *obj;
+
+		memcpy(&pb_size, s->buf + off, sizeof(pb_size));
+		off += sizeof(pb_size);
+
+		obj = s->pb_info->unpack(&pb_allocator, pb_size, s->buf + off);
+		if (!obj) {
+			pr_err("Can't unpack entry #%d\n", s->first + i);
+			ret = -1;
+			goto out;
+		}
+		off += pb_size;
+
+		if (i)
+			fputc(',', f);
+		json_dump_indent(f, SHARD_FLAGS, 2, i != 0);
+		ret = protobuf_dump_json(s->pb_info->desc, obj, f, SHARD_FLAGS, 2);
+		s->pb_info->free(obj, &pb_allocator);
+		if (ret) {
+			pr_err("Can't convert entry #%d to json\n", s->first + i);
+			goto out;
+		}
+	}
+
+	json_dump_indent(f, SHARD_FLAGS, 1, false);
+	fputc(']', f);
+	json_dump_indent(f, SHARD_FLAGS, 0, false);
+	fputc('}', f);
+
+	ret = 0;
+out:
+	if (fclose(f)) {
+		pr_perror("Can't write shard %s", s->path);
+		ret = -1;
+	}
+	mem_untag(tag);
+	return ret;
+}
+
+static int add_shard(json_t *shards, struct shard *s)
+{
+	json_t *js = json_object();
+
+	if (!js || json_array_append_new(shards, js) ||
+	    json_object_set_new(js, "file", json_string(basename(s->path))) ||
+	    json_object_set_new(js, "first", json_integer(s->first)) ||
+	    json_object_set_new(js, "count", json_integer(s->count)) ||
+	    json_object_set_new(js, "size", json_integer(s->size)) ||
+	    json_object_set_new(js, "crc32c", json_integer(s->crc))) {
+		pr_err("Can't add shard to manifest\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int img_to_shards(const char *in, const char *out, size_t shard_size)
+{
+	struct criu_image_info *info;
+	struct shard *shards = NULL;
+	json_t *js = NULL, *js_shards;
+	int fd_in, nr, i, nr_entries = 0, ret = -1;
+	bool eof = false;
+	uint32_t magic;
+	FILE *f;
+
+	if (!strcmp(out, "-") || !strncmp(out, "fd:", 3)) {
+		pr_err("Sharded output needs a file name\n");
+		return -1;
+	}
+
+	crc32c_init();
+
+	fd_in = img_open(in, O_RDONLY);
+	if (fd_in < 0)
+		return -1;
+
+	if (read_all(fd_in, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_err("Can't read magic from %s\n", in);
+		goto out;
+	}
+
+	info = find_img_info(magic);
+	if (!info) {
+		pr_err("%s: unknown magic\n", in);
+		goto out;
+	}
+
+	js = json_object();
+	js_shards = json_array();
+	if (!js || json_object_set_new(js, "magic", json_integer(magic)) ||
+	    json_object_set_new(js, "version", json_integer(IMG_JSON_VERSION)) ||
+	    json_object_set_new(js, "shards", js_shards)) {
+		pr_err("Can't allocate manifest\n");
+		goto out;
+	}
+
+	if (img_has_header(info)) {
+		json_t *js_header;
+		void *obj;
+
+		if (read_pb(fd_in, &obj, &info->header_info) <= 0) {
+			pr_err("Can't read header from %s\n", in);
+			goto out;
+		}
+
+		if (protobuf_to_json(info->header_info.desc, obj, &js_header)) {
+			info->header_info.free(obj, &pb_allocator);
+			goto out;
+		}
+		info->header_info.free(obj, &pb_allocator);
+
+		if (json_object_set_new(js, "header", js_header))
+			goto out;
+	}
+
+	nr = nr_workers();
+	shards = mem_calloc(nr, sizeof(*shards));
+	if (!shards) {
+		pr_err("Can't allocate shards\n");
+		goto out;
+	}
+
+	while (info->is_array && !eof) {
+		int nr_read;
+
+		for (nr_read = 0; nr_read < nr; nr_read++) {
+			struct shard *s = &shards[nr_read];
+
+			s->pb_info = &info->extra_info;
+			s->magic = magic;
+			s->first = nr_entries;
+			s->count = 0;
+
+			if (shard_read(fd_in, s, shard_size) < 0)
+				goto out;
+			if (s->count == 0) {
+				eof = true;
+				break;
+			}
+
+			snprintf(s->path, sizeof(s->path), "%s.%zu",
+				 out, json_array_size(js_shards) + nr_read);
+			nr_entries += s->count;
+		}
+
+		if (run_parallel(nr_read, shard_to_json, shards))
+			goto out;
+
+		for (i = 0; i < nr_read; i++) {
+			if (add_shard(js_shards, &shards[i]))
+				goto out;
+			shard_reset(&shards[i]);
+		}
+	}
+
+	if (json_object_set_new(js, "entries", json_integer(nr_entries))) {
+		pr_err("Can't build manifest\n");
+		goto out;
+	}
+
+	f = img_fopen(out, "w");
+	if (!f)
+		goto out;
+
+	ret = json_dumpf(js, f, JSON_INDENT(4));
+	if (fclose(f))
+		ret = -1;
+	if (ret)
+		pr_err("Can't write manifest %s\n", out);
+out:
+	for (i = 0; shards && i < nr; i++)
+		shard_reset(&shards[i]);
+	mem_free(shards);
+	if (js)
+		json_decref(js);
+	close(fd_in);
+	return ret;
+}
+
+static int shard_to_img(void *arg, int idx)
+{
+	struct shard *s = (struct shard *)arg + idx;
+	json_t *js = NULL, *js_entries, *entry;
+	json_error_t jerror;
+	void *doc = NULL, *buf;
+	size_t doc_len, len, i;
+	int fd, ret = -1;
+
+	fd = open(s->path, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open shard %s", s->path);
+		return -1;
+	}
+
+	if (read_fd_all(fd, &doc, &doc_len))
+		goto out;
+
+	if (doc_len != s->size || crc32c(doc, doc_len) != s->crc) {
+		pr_err("Shard %s doesn't match its checksum\n", s->path);
+		goto out;
+	}
+
+	js = json_loadb(doc, doc_len, 0, &jerror);
+	if (!js) {
+		pr_err("%s: json parsing error at line %d col %d: %s\n",
+		       s->path, jerror.line, jerror.column, jerror.text);
+		goto out;
+	}
+
+	js_entries = json_object_get(js, "entries");
+	if (json_array_size(js_entries) != (size_t)s->count ||
+	    json_integer_value(json_object_get(js, "first")) != s->first) {
+		pr_err("Shard %s doesn't hold entries #%d-%d\n", s->path,
+		       s->first, s->first + s->count - 1);
+		goto out;
+	}
+
+	json_array_foreach(js_entries, i, entry) {
+		if (img_pack_json(s->pb_info, entry, &buf, &len)) {
+			pr_err("Can't convert entry #%zu to protobuf\n", s->first + i);
+			goto out;
+		}
+
+		ret = shard_reserve(s, len);
+		if (!ret) {
+			memcpy(s->buf + s->len, buf, len);
+			s->len += len;
+		}
+		mem_free(buf);
+		if (ret)
+			goto out;
+	}
+
+	ret = 0;
+out:
+	if (js)
+		json_decref(js);
+	mem_free(doc);
+	close(fd);
+	return ret;
+}
+
+static int shard_entry_int(json_t *js, const char *key, json_int_t max, json_int_t *val)
+{
+	json_t *js_val = json_object_get(js, key);
+
+	if (!json_is_integer(js_val))
+		return -1;
+
+	*val = json_integer_value(js_val);
+	return *val < 0 || *val > max ? -1 : 0;
+}
+
+int shards_to_img(json_t *js, const char *manifest, int fd_out)
+{
+	struct criu_image_info *info;
+	struct shard *shards = NULL;
+	json_t *js_shards, *js_header;
+	char dir[PATH_MAX];
+	int nr, i, j, ret = -1;
+	json_int_t next = 0;
+	size_t n;
+	uint32_t magic;
+	void *buf;
+	size_t len;
+
+	crc32c_init();
+
+	snprintf(dir, sizeof(dir), "%s", manifest);
+	snprintf(dir, sizeof(dir), "%s", dirname(dir));
+
+	magic = json_integer_value(json_object_get(js, "magic"));
+	info = find_img_info(magic);
+	if (!info) {
+		pr_err("Unknown magic\n");
+		return -1;
+	}
+
+	if (write_all(fd_out, &magic, sizeof(magic)))
+		return -1;
+
+	js_header = json_object_get(js, "header");
+	if (!js_header && img_has_header(info)) {
+		pr_err("No header in manifest\n");
+		return -1;
+	}
+
+	if (js_header) {
+		if (img_pack_json(&info->header_info, js_header, &buf, &len)) {
+			pr_err("Can't convert header to protobuf\n");
+			return -1;
+		}
+		ret = write_all(fd_out, buf, len);
+		mem_free(buf);
+		if (ret)
+			return -1;
+		ret = -1;
+	}
+
+	js_shards = json_object_get(js, "shards");
+	n = json_array_size(js_shards);
+	if (n && !info->is_array) {
+		pr_err("Entries of single message image\n");
+		return -1;
+	}
+
+	nr = nr_workers();
+	shards = mem_calloc(nr, sizeof(*shards));
+	if (!shards) {
+		pr_err("Can't allocate shards\n");
+		return -1;
+	}
+
+	for (i = 0; i < n; i += nr) {
+		int nr_batch = n - i < nr ? n - i : nr;
+
+		for (j = 0; j < nr_batch; j++) {
+			json_t *js_shard = json_array_get(js_shards, i + j);
+			struct shard *s = &shards[j];
+			const char *file;
+			json_int_t first, count, size, crc;
+
+			file = json_string_value(json_object_get(js_shard, "file"));
+			if (!file || strchr(file, '/') ||
+			    shard_entry_int(js_shard, "first", INT_MAX, &first) ||
+			    shard_entry_int(js_shard, "count", INT_MAX, &count) ||
+			    shard_entry_int(js_shard, "size", SSIZE_MAX, &size) ||
+			    shard_entry_int(js_shard, "crc32c", UINT32_MAX, &crc)) {
+				pr_err("Bad shard #%d in manifest\n", i + j);
+				goto out;
+			}
+
+			/* Entries have to come out in order with no gaps */
+			if (first != next) {
+				pr_err("Shard %s starts at #%lld instead of #%lld\n",
+				       file, (long long)first, (long long)next);
+				goto out;
+			}
+			next += count;
+
+			snprintf(s->path, sizeof(s->path), "%s/%s", dir, file);
+			s->pb_info = &info->extra_info;
+			s->first = first;
+			s->count = count;
+			s->size = size;
+			s->crc = crc;
+		}
+
+		if (run_parallel(nr_batch, shard_to_img, shards))
+			goto out;
+
+		for (j = 0; j < nr_batch; j++) {
+			if (write_all(fd_out, shards[j].buf, shards[j].len))
+				goto out;
+			shard_reset(&shards[j]);
+		}
+	}
+
+	if (next != json_integer_value(json_object_get(js, "entries"))) {
+		pr_err("Shards hold %lld entries instead of %lld\n", (long long)next,
+		       (long long)json_integer_value(json_object_get(js, "entries")));
+		goto out;
+	}
+
+	ret = 0;
+out:
+	for (j = 0; j < nr; j++)
+		shard_reset(&shards[j]);
+	mem_free(shards);
+	return ret;
+}
@@ -0,0 +1,381 @@
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include "log.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "pool.h"
+#include "tree.h"
+
+/*
+ * tree mode joins the images of a whole dump directory into one document:
+ *
+ * {"processes": [{"pid": P, "pstree": {...}, "core": {...}, "ids": {...},
+ *		  "mm": {...}, "vmas": [...], "fds": [{..., "file": {...}}]}]}
+ *
+ * fdinfo entries reference shared file images by id, these references are
+ * resolved through per-image id -> entry tables.
+ */
+
+/* fd_types enum name -> image holding entries of this type */
+static struct file_img {
+	const char	*type;
+	const char	*name;
+} file_imgs[] = {
+	{ "REG",	"reg-files.img"	},
+	{ "PIPE",	"pipes.img"	},
+	{ "FIFO",	"fifo.img"	},
+	{ "INETSK",	"inetsk.img"	},
+	{ "UNIXSK",	"unixsk.img"	},
+	{ "EVENTFD",	"eventfd.img"	},
+	{ "EVENTPOLL",	"eventpoll.img"	},
+	{ "INOTIFY",	"inotify.img"	},
+	{ "SIGNALFD",	"signalfd.img"	},
+	{ "PACKETSK",	"packetsk.img"	},
+	{ "TTY",	"tty.img"	},
+	{ "FANOTIFY",	"fanotify.img"	},
+	{ "NETLINKSK",	"netlinksk.img"	},
+	{ "NS",		"ns-files.img"	},
+	{ "TUNF",	"tunfile.img"	},
+	{ "EXT",	"ext-files.img"	},
+	{ "TIMERFD",	"timerfd.img"	},
+	{}
+};
+
+#define NR_FILE_IMGS	(sizeof(file_imgs) / sizeof(file_imgs[0]) - 1)
+
+/* per-process images, loaded along with the shared ones */
+static const char *proc_imgs[] = { "core", "ids", "mm", "vmas" };
+
+#define NR_PROC_IMGS	(sizeof(proc_imgs) / sizeof(proc_imgs[0]))
+
+/* Loads dir/name.img, or dir/name-pid.img for per-process ones */
+struct tree_job {
+	const char	*dir;
+	const char	*name;
+	int		pid;
+	json_t		*js;
+};
+
+static int load_job(void *arg, int idx)
+{
+	struct tree_job *job = (struct tree_job *)arg + idx;
+	char path[PATH_MAX];
+
+	if (!job->name)
+		return 0;
+
+	if (job->pid < 0)
+		snprintf(path, sizeof(path), "%s/%s", job->dir, job->name);
+	else
+		snprintf(path, sizeof(path), "%s/%s-%d.img", job->dir, job->name, job->pid);
+
+	if (access(path, F_OK))
+		return 0;
+
+	pr_info("Loading %s\n", path);
+
+	if (img_load_json(path, &job->js)) {
+		pr_err("Can't load %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void set_job(struct tree_job *job, const char *dir, const char *name, int pid)
+{
+	job->dir = dir;
+	job->name = name;
+	job->pid = pid;
+}
+
+struct files_id {
+	int	id;
+	int	idx;
+};
+
+static int cmp_files_ids(const void *a, const void *b)
+{
+	const struct files_id *x = a, *y = b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return x->idx - y->idx;
+}
+
+/* owner[i] is the first task sharing files table of task i */
+static int find_owners(int *ids, int *owner, int n)
+{
+	struct files_id *sorted;
+	int i;
+
+	sorted = mem_alloc((n ? n : 1) * sizeof(*sorted));
+	if (!sorted)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		sorted[i].id = ids[i];
+		sorted[i].idx = i;
+	}
+
+	qsort(sorted, n, sizeof(*sorted), cmp_files_ids);
+
+	for (i = 0; i < n; i++)
+		owner[sorted[i].idx] = i && sorted[i - 1].id == sorted[i].id ?
+					owner[sorted[i - 1].idx] : sorted[i].idx;
+
+	mem_free(sorted);
+	return 0;
+}
+
+static int json_entry_int(json_t *js, const char *key, int *val)
+{
+	json_t *js_val = json_object_get(js, key);
+
+	if (!json_is_integer(js_val))
+		return -1;
+
+	*val = (int)json_integer_value(js_val);
+	return 0;
+}
+
+/* Collect all entries of an image into a json array */
+static json_t *img_entries(json_t *js)
+{
+	json_t *arr, *entry;
+	int i;
+
+	arr = json_array();
+	if (!arr)
+		return NULL;
+
+	for (i = 0; js && (entry = img_json_entry(js, i)); i++)
+		json_array_append(arr, entry);
+
+	return arr;
+}
+
+/* Build {"<id>": entry} table for a shared file image */
+static json_t *build_id_index(json_t *js)
+{
+	json_t *index, *entry;
+	char key[16];
+	int i, id;
+
+	index = json_object();
+	if (!index)
+		return NULL;
+
+	for (i = 0; js && (entry = img_json_entry(js, i)); i++) {
+		if (json_entry_int(entry, "id", &id))
+			continue;
+
+		snprintf(key, sizeof(key), "%u", (unsigned)id);
+		json_object_set(index, key, entry);
+	}
+
+	return index;
+}
+
+static int resolve_fds(json_t *fds, json_t *indexes[])
+{
+	json_t *fd, *file;
+	size_t i;
+	char key[16];
+	int k, id;
+
+	json_array_foreach(fds, i, fd) {
+		const char *type;
+
+		type = json_string_value(json_object_get(fd, "type"));
+		if (!type || json_entry_int(fd, "id", &id))
+			continue;
+
+		for (k = 0; file_imgs[k].type; k++)
+			if (!strcmp(file_imgs[k].type, type))
+				break;
+
+		if (!file_imgs[k].type) {
+			pr_info("No file image for fd type %s\n", type);
+			continue;
+		}
+
+		snprintf(key, sizeof(key), "%u", (unsigned)id);
+		file = json_object_get(indexes[k], key);
+		if (!file) {
+			pr_info("Can't resolve %s file id %d\n", type, id);
+			continue;
+		}
+
+		if (json_object_set(fd, "file", file)) {
+			pr_err("Can't add file to fd\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int tree_to_json(char dir[], char out[])
+{
+	char path[PATH_MAX];
+	json_t *js_pstree = NULL, *js = NULL, *procs;
+	json_t *indexes[NR_FILE_IMGS] = {};
+	json_t **fds = NULL;
+	struct tree_job *jobs = NULL, *fd_jobs = NULL;
+	int nr_procs, nr_jobs, i, j, k, ret = -1;
+	int *files_ids = NULL, *owner = NULL;
+
+	snprintf(path, sizeof(path), "%s/pstree.img", dir);
+	if (img_load_json(path, &js_pstree)) {
+		pr_err("Can't load %s\n", path);
+		goto out;
+	}
+
+	for (nr_procs = 0; img_json_entry(js_pstree, nr_procs); nr_procs++)
+		;
+
+	/*
+	 * Shared file images go first, then NR_PROC_IMGS slots
+	 * per process in pstree order.
+	 */
+	nr_jobs = NR_FILE_IMGS + nr_procs * NR_PROC_IMGS;
+	jobs = mem_calloc(nr_jobs, sizeof(*jobs));
+	fd_jobs = mem_calloc(nr_procs, sizeof(*fd_jobs));
+	files_ids = mem_calloc(nr_procs, sizeof(*files_ids));
+	owner = mem_calloc(nr_procs, sizeof(*owner));
+	fds = mem_calloc(nr_procs, sizeof(*fds));
+	if (!jobs || !fd_jobs || !files_ids || !owner || !fds) {
+		pr_err("Can't allocate tree jobs\n");
+		goto out;
+	}
+
+	for (k = 0; k < NR_FILE_IMGS; k++)
+		set_job(&jobs[k], dir, file_imgs[k].name, -1);
+
+	for (i = 0; i < nr_procs; i++) {
+		int pid;
+
+		if (json_entry_int(img_json_entry(js_pstree, i), "pid", &pid)) {
+			pr_err("No pid in pstree entry #%d\n", i);
+			goto out;
+		}
+
+		for (j = 0; j < NR_PROC_IMGS; j++)
+			set_job(&jobs[NR_FILE_IMGS + i * NR_PROC_IMGS + j],
+				dir, proc_imgs[j], pid);
+
+		files_ids[i] = pid;
+	}
+
+	if (run_parallel(nr_jobs, load_job, jobs))
+		goto out;
+
+	for (k = 0; k < NR_FILE_IMGS; k++) {
+		indexes[k] = build_id_index(jobs[k].js);
+		if (!indexes[k]) {
+			pr_err("Can't build id index for %s\n", file_imgs[k].name);
+			goto out;
+		}
+	}
+
+	/*
+	 * fdinfo images are per files table, so tasks sharing
+	 * one are loaded once. Old dumps without ids use pid.
+	 */
+	for (i = 0; i < nr_procs; i++) {
+		json_t *ids = img_json_entry(jobs[NR_FILE_IMGS + i * NR_PROC_IMGS + 1].js, 0);
+
+		if (ids)
+			json_entry_int(ids, "files_id", &files_ids[i]);
+	}
+
+	if (find_owners(files_ids, owner, nr_procs)) {
+		pr_err("Can't sort files ids\n");
+		goto out;
+	}
+
+	for (i = 0; i < nr_procs; i++)
+		if (owner[i] == i)
+			set_job(&fd_jobs[i], dir, "fdinfo", files_ids[i]);
+
+	if (run_parallel(nr_procs, load_job, fd_jobs))
+		goto out;
+
+	for (i = 0; i < nr_procs; i++) {
+		if (owner[i] != i) {
+			fds[i] = json_incref(fds[owner[i]]);
+			continue;
+		}
+
+		fds[i] = img_entries(fd_jobs[i].js);
+		if (!fds[i] || resolve_fds(fds[i], indexes))
+			goto out;
+	}
+
+	js = json_object();
+	procs = json_array();
+	if (!js || !procs || json_object_set_new(js, "processes", procs)) {
+		pr_err("Can't allocate tree json\n");
+		goto out;
+	}
+
+	for (i = 0; i < nr_procs; i++) {
+		json_t *proc, *entry = img_json_entry(js_pstree, i);
+		struct tree_job *pjobs = &jobs[NR_FILE_IMGS + i * NR_PROC_IMGS];
+
+		proc = json_object();
+		if (!proc || json_array_append_new(procs, proc)) {
+			pr_err("Can't allocate process json\n");
+			goto out;
+		}
+
+		json_object_set(proc, "pid", json_object_get(entry, "pid"));
+		json_object_set(proc, "pstree", entry);
+
+		for (j = 0; j < NR_PROC_IMGS; j++) {
+			if (!pjobs[j].js)
+				continue;
+
+			if (!strcmp(proc_imgs[j], "vmas"))
+				json_object_set_new(proc, proc_imgs[j], img_entries(pjobs[j].js));
+			else if (img_json_entry(pjobs[j].js, 0))
+				json_object_set(proc, proc_imgs[j], img_json_entry(pjobs[j].js, 0));
+		}
+
+		json_object_set(proc, "fds", fds[i]);
+	}
+
+	ret = json_dump_file(js, out, JSON_INDENT(4));
+	if (ret)
+		pr_err("Can't dump json object\n");
+out:
+	if (js)
+		json_decref(js);
+	for (i = 0; fds && i < nr_procs; i++)
+		if (fds[i])
+			json_decref(fds[i]);
+	for (i = 0; fd_jobs && i < nr_procs; i++)
+		if (fd_jobs[i].js)
+			json_decref(fd_jobs[i].js);
+	for (i = 0; jobs && i < nr_jobs; i++)
+		if (jobs[i].js)
+			json_decref(jobs[i].js);
+	for (k = 0; k < NR_FILE_IMGS; k++)
+		if (indexes[k])
+			json_decref(indexes[k]);
+	if (js_pstree)
+		json_decref(js_pstree);
+	mem_free(fds);
+	mem_free(owner);
+	mem_free(files_ids);
+	mem_free(fd_jobs);
+	mem_free(jobs);
+	return ret;
+}
@@ -0,0 +1,199 @@
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "log.h"
+#include "protobuf2json.h"
+#include "criu2json.h"
+#include "image.h"
+#include "mem.h"
+#include "pool.h"
+#include "verify.h"
+
+/*
+ * verify does img -> json -> img round trip for every entry in memory
+ * and compares the packed result with the original bytes.
+ */
+
+/* Find the first field that didn't survive the round trip */
+static const char *mismatched_field(const ProtobufCMessageDescriptor *desc,
+				    const void *orig, const void *pb)
+{
+	json_t *js_orig = NULL, *js_pb = NULL;
+	const char *name = NULL;
+	int i;
+
+	if (protobuf_to_json(desc, orig, &js_orig))
+		return NULL;
+	if (protobuf_to_json(desc, pb, &js_pb)) {
+		json_decref(js_orig);
+		return NULL;
+	}
+
+	for (i = 0; i < desc->n_fields; i++) {
+		json_t *a = json_object_get(js_orig, desc->fields[i].name);
+		json_t *b = json_object_get(js_pb, desc->fields[i].name);
+
+		if (!a != !b || (a && !json_equal(a, b))) {
+			name = desc->fields[i].name;
+			break;
+		}
+	}
+
+	json_decref(js_orig);
+	json_decref(js_pb);
+	return name;
+}
+
+static int verify_entry(const char *path, int idx, struct protobuf_info *pb_info,
+			void *buf, int size)
+{
+	void *obj = NULL, *pb = NULL, *packed = NULL;
+	json_t *js = NULL;
+	int pb_size, ret = -1;
+
+	obj = pb_info->unpack(&pb_allocator, size, buf);
+	if (!obj) {
+		pr_err("%s: can't unpack entry #%d\n", path, idx);
+		goto out;
+	}
+
+	if (protobuf_to_json(pb_info->desc, obj, &js)) {
+		pr_err("%s: can't convert entry #%d to json\n", path, idx);
+		js = NULL;
+		goto out;
+	}
+
+	if (json_to_protobuf(pb_info->desc, js, &pb)) {
+		pr_err("%s: can't convert entry #%d back to protobuf\n", path, idx);
+		goto out;
+	}
+
+	pb_size = pb_info->getpksize(pb);
+	packed = mem_alloc(pb_size);
+	if (!packed) {
+		pr_err("Can't allocate buffer for packed pb object\n");
+		goto out;
+	}
+
+	if (pb_info->pack(pb, packed) != pb_size) {
+		pr_err("%s: failed to pack entry #%d\n", path, idx);
+		goto out;
+	}
+
+	if (pb_size != size || memcmp(packed, buf, size)) {
+		const char *field;
+		int off;
+
+		for (off = 0; off < size && off < pb_size; off++)
+			if (((char *)packed)[off] != ((char *)buf)[off])
+				break;
+
+		field = mismatched_field(pb_info->desc, obj, pb);
+		pr_err("%s: entry #%d differs at byte %d (size %d vs %d), field %s\n",
+		       path, idx, off, size, pb_size, field ? field : "unknown");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	mem_free(packed);
+	if (pb)
+		pb_info->free(pb, &pb_allocator);
+	if (js)
+		json_decref(js);
+	if (obj)
+		pb_info->free(obj, &pb_allocator);
+	return ret;
+}
+
+struct verify {
+	char **paths;
+	bool skip_unknown;
+};
+
+static int verify_img(void *arg, int idx)
+{
+	struct verify *v = arg;
+	const char *path = v->paths[idx];
+	struct criu_image_info *info;
+	uint32_t magic;
+	int fd, i, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	if (read(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_perror("Can't read magic from %s", path);
+		goto out;
+	}
+
+	info = find_img_info(magic);
+	if (!info && v->skip_unknown) {
+		pr_info("Skipping %s with unknown magic\n", path);
+		ret = 0;
+		goto out;
+	} else if (!info) {
+		pr_err("%s: unknown magic\n", path);
+		goto out;
+	}
+
+	for (i = 0; ; i++) {
+		struct protobuf_info *pb_info;
+		void *buf;
+		int size;
+
+		if (i == 0)
+			pb_info = &info->header_info;
+		else if (info->is_array)
+			pb_info = &info->extra_info;
+		else
+			break;
+
+		ret = read_pb_buf(fd, &buf, &size);
+		if (ret < 0) {
+			pr_err("%s: can't read entry #%d\n", path, i);
+			goto out;
+		} else if (ret == 0)
+			break;
+
+		ret = verify_entry(path, i, pb_info, buf, size);
+		mem_free(buf);
+		if (ret)
+			goto out;
+	}
+
+	pr_info("%s: %d entries OK\n", path, i);
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+int verify_imgs(char src[])
+{
+	struct verify v;
+	int n, ret;
+
+	n = img_list(src, &v.paths);
+	if (n < 0)
+		return -1;
+
+	/* Directories may hold files that aren't criu images */
+	v.skip_unknown = img_is_dir(src);
+	ret = run_parallel(n, verify_img, &v);
+	if (ret)
+		pr_err("Round trip verification failed\n");
+	else
+		pr_info("%d images verified\n", n);
+
+	img_list_free(v.paths, n);
+	return ret;
+}
@@ -0,0 +1,472 @@
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <linux/limits.h>
+
+#include "log.h"
+#include "criu2json.h"
+#include "image.h"
+#include "pool.h"
+#include "watch.h"
+
+/*
+ * watch converts images as criu closes them in the dump directory.
+ * Progress is kept in OUT/manifest.json:
+ *
+ * {"source": DIR, "complete": false,
+ *  "images": {"core-1.img": {"status": "done", "size": S, "mtime_ns": T}}}
+ *
+ * Only one job per image runs at a time. If the image changes while it
+ * is being converted, it is queued again once the running job is done.
+ * Images that an earlier run left "done" are not converted again unless
+ * their size or mtime changed. Workers only update the manifest in memory,
+ * the main thread writes it out at most once a second.
+ *
+ * Watching stops once stats-dump.img (the last image criu writes) is
+ * converted or on SIGINT/SIGTERM.
+ */
+
+#define WATCH_LAST_IMG	"stats-dump.img"
+#define MANIFEST_NAME	"manifest.json"
+#define MANIFEST_FLUSH_MS	1000
+
+struct watch {
+	const char		*dir;
+	const char		*out;
+	json_t			*manifest;
+	json_t			*js_images;
+	/* images of the manifest left by an earlier run */
+	json_t			*js_prev;
+	/* images changed while being converted, to be queued again */
+	json_t			*js_rerun;
+	/* manifest changed since it was written out */
+	bool			dirty;
+	struct workqueue	*wq;
+	pthread_mutex_t		lock;
+};
+
+struct watch_job {
+	struct watch		*w;
+	char			name[NAME_MAX + 1];
+};
+
+static volatile sig_atomic_t watch_stop;
+
+static void watch_sighandler(int sig)
+{
+	watch_stop = 1;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Writes the manifest out if it changed, called by the main thread only */
+static int write_manifest(struct watch *w)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	char *str = NULL;
+	int fd, ret = -1;
+	bool dirty;
+
+	/* Only serializing happens under the lock, workers don't wait for io */
+	pthread_mutex_lock(&w->lock);
+	dirty = w->dirty;
+	if (dirty) {
+		str = json_dumps(w->manifest, JSON_INDENT(4));
+		if (str)
+			w->dirty = false;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if (!dirty)
+		return 0;
+	if (!str) {
+		pr_err("Can't serialize manifest\n");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", w->out, MANIFEST_NAME);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_perror("Can't open %s", tmp);
+		goto out;
+	}
+
+	if (write_all(fd, str, strlen(str))) {
+		close(fd);
+		goto out;
+	}
+	close(fd);
+
+	if (rename(tmp, path)) {
+		pr_perror("Can't rename %s", tmp);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	free(str);
+	return ret;
+}
+
+/* Picks up the manifest of an earlier run over the same directory */
+static int load_manifest(struct watch *w)
+{
+	char path[PATH_MAX];
+	json_error_t err;
+	json_t *js, *js_src, *js_images;
+
+	snprintf(path, sizeof(path), "%s/%s", w->out, MANIFEST_NAME);
+	if (access(path, F_OK))
+		return 0;
+
+	js = json_load_file(path, 0, &err);
+	if (!js) {
+		pr_err("Can't parse %s: %s, converting everything\n", path, err.text);
+		return 0;
+	}
+
+	js_src = json_object_get(js, "source");
+	js_images = json_object_get(js, "images");
+	if (json_is_string(js_src) && !strcmp(json_string_value(js_src), w->dir) &&
+	    json_is_object(js_images))
+		w->js_prev = json_incref(js_images);
+	else
+		pr_info("%s is of another directory, ignoring it\n", path);
+
+	json_decref(js);
+	return 0;
+}
+
+static bool img_status_is(json_t *js_img, const char *status)
+{
+	const char *str = json_string_value(json_object_get(js_img, "status"));
+
+	return str && !strcmp(str, status);
+}
+
+static void json_path(struct watch *w, const char *name, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%.*s.json", w->out, (int)strlen(name) - 4, name);
+}
+
+/* Returns true if the image changed meanwhile and has to be converted again */
+static bool set_status(struct watch *w, const char *name, const char *status)
+{
+	json_t *js_img;
+	bool rerun;
+
+	pthread_mutex_lock(&w->lock);
+	js_img = json_object_get(w->js_images, name);
+	if (js_img)
+		json_object_set_new(js_img, "status", json_string(status));
+	w->dirty = true;
+	rerun = json_object_get(w->js_rerun, name) != NULL;
+	if (rerun)
+		json_object_del(w->js_rerun, name);
+	pthread_mutex_unlock(&w->lock);
+
+	return rerun;
+}
+
+static long long mtime_ns(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static int queue_img(struct watch *w, const char *name);
+
+static bool img_has_magic(const char *path)
+{
+	uint32_t magic;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	ret = read(fd, &magic, sizeof(magic));
+	close(fd);
+
+	return ret == sizeof(magic) && find_img_info(magic);
+}
+
+static int convert_job(void *arg, void *data)
+{
+	struct watch_job *job = data;
+	struct watch *w = job->w;
+	char in[PATH_MAX], out[PATH_MAX];
+	bool rerun;
+	int ret = 0;
+
+	snprintf(in, sizeof(in), "%s/%s", w->dir, job->name);
+	json_path(w, job->name, out, sizeof(out));
+
+	if (!img_has_magic(in)) {
+		pr_info("Skipping %s, not a protobuf image\n", in);
+		rerun = set_status(w, job->name, "skipped");
+		goto out;
+	}
+
+	pr_info("Converting %s\n", in);
+
+	ret = img_to_json(in, out);
+	if (ret)
+		pr_err("Can't convert %s\n", in);
+
+	rerun = set_status(w, job->name, ret ? "failed" : "done");
+out:
+	if (rerun && queue_img(w, job->name))
+		ret = -1;
+	free(job);
+	return ret;
+}
+
+static int queue_img(struct watch *w, const char *name)
+{
+	char path[PATH_MAX], out[PATH_MAX];
+	struct watch_job *job;
+	json_t *js_img;
+	struct stat st;
+
+	if (!img_name_listed(name))
+		return 0;
+
+	snprintf(path, sizeof(path), "%s/%s", w->dir, name);
+	if (stat(path, &st)) {
+		if (errno == ENOENT)
+			return 0;
+		pr_perror("Can't stat %s", path);
+		return -1;
+	}
+
+	/* Converted by an earlier run, trust it only if the json is still there */
+	json_path(w, name, out, sizeof(out));
+
+	pthread_mutex_lock(&w->lock);
+	js_img = json_object_get(w->js_images, name);
+	if (!js_img) {
+		js_img = json_object_get(w->js_prev, name);
+		if (js_img && img_status_is(js_img, "done") && !access(out, F_OK)) {
+			json_object_set(w->js_images, name, js_img);
+			w->dirty = true;
+		} else
+			js_img = NULL;
+	}
+
+	if (js_img && img_status_is(js_img, "queued")) {
+		json_object_set_new(w->js_rerun, name, json_true());
+		pthread_mutex_unlock(&w->lock);
+		pr_info("%s is being converted, will be queued again\n", name);
+		return 0;
+	}
+
+	if (js_img &&
+	    json_integer_value(json_object_get(js_img, "size")) == st.st_size &&
+	    json_integer_value(json_object_get(js_img, "mtime_ns")) == mtime_ns(&st)) {
+		pthread_mutex_unlock(&w->lock);
+		pr_info("%s is already converted\n", name);
+		return 0;
+	}
+
+	js_img = json_object();
+	json_object_set_new(js_img, "status", json_string("queued"));
+	json_object_set_new(js_img, "size", json_integer(st.st_size));
+	json_object_set_new(js_img, "mtime_ns", json_integer(mtime_ns(&st)));
+	json_object_set_new(w->js_images, name, js_img);
+	w->dirty = true;
+	pthread_mutex_unlock(&w->lock);
+
+	job = malloc(sizeof(*job));
+	if (!job) {
+		pr_err("Can't allocate job\n");
+		return -1;
+	}
+
+	job->w = w;
+	snprintf(job->name, sizeof(job->name), "%s", name);
+
+	return wq_queue(w->wq, job);
+}
+
+/* Queues all images of the directory, returns 1 if the last one is there */
+static int scan_dir(struct watch *w)
+{
+	char **names;
+	int n, i, ret = 0;
+	bool last = false;
+
+	n = img_list(w->dir, &names);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n && !ret; i++) {
+		const char *name = strrchr(names[i], '/') + 1;
+
+		ret = queue_img(w, name);
+		if (!strcmp(name, WATCH_LAST_IMG))
+			last = true;
+	}
+
+	img_list_free(names, n);
+	return ret ? -1 : last;
+}
+
+static int watch_events(struct watch *w, int ifd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+	long long flushed = now_ms();
+	bool last = false;
+	ssize_t len;
+	char *ptr;
+	int ret;
+
+	while (!last && !watch_stop) {
+		if (now_ms() - flushed >= MANIFEST_FLUSH_MS) {
+			if (write_manifest(w))
+				return -1;
+			flushed = now_ms();
+		}
+
+		ret = poll(&pfd, 1, MANIFEST_FLUSH_MS);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			pr_perror("Can't poll inotify");
+			return -1;
+		}
+		if (ret == 0)
+			continue;
+
+		len = read(ifd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			pr_perror("Can't read inotify events");
+			return -1;
+		}
+
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+
+			if (ev->mask & IN_IGNORED) {
+				pr_err("%s is gone\n", w->dir);
+				return -1;
+			}
+
+			/* Events were lost, look at the whole directory again */
+			if (ev->mask & IN_Q_OVERFLOW) {
+				pr_info("inotify queue overflow, rescanning %s\n", w->dir);
+				ret = scan_dir(w);
+				if (ret < 0)
+					return -1;
+				if (ret)
+					last = true;
+				continue;
+			}
+
+			if (!ev->len)
+				continue;
+
+			if (queue_img(w, ev->name))
+				return -1;
+
+			if (!strcmp(ev->name, WATCH_LAST_IMG))
+				last = true;
+		}
+	}
+
+	return 0;
+}
+
+int watch_dir(char dir[], char out[])
+{
+	struct watch w = { .dir = dir, .out = out, .lock = PTHREAD_MUTEX_INITIALIZER };
+	struct sigaction sa = { .sa_handler = watch_sighandler };
+	int ifd, ret = -1;
+
+	if (mkdir(out, 0700) && errno != EEXIST) {
+		pr_perror("Can't create %s", out);
+		return -1;
+	}
+
+	w.manifest = json_object();
+	w.js_images = json_object();
+	w.js_rerun = json_object();
+	if (!w.manifest || !w.js_images || !w.js_rerun ||
+	    json_object_set_new(w.manifest, "source", json_string(dir)) ||
+	    json_object_set_new(w.manifest, "complete", json_false()) ||
+	    json_object_set(w.manifest, "images", w.js_images)) {
+		pr_err("Can't allocate manifest\n");
+		goto out;
+	}
+
+	if (load_manifest(&w))
+		goto out;
+
+	/* No SA_RESTART, so that read() from inotify gets interrupted */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Start watching before the scan, so that no image is missed */
+	ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd < 0) {
+		pr_perror("Can't init inotify");
+		goto out;
+	}
+
+	if (inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		pr_perror("Can't watch %s", dir);
+		goto out_close;
+	}
+
+	w.wq = wq_start(convert_job, &w);
+	if (!w.wq)
+		goto out_close;
+
+	ret = scan_dir(&w);
+	if (ret == 0)
+		ret = watch_events(&w, ifd);
+	else if (ret > 0)
+		ret = 0;
+
+	if (wq_stop(w.wq))
+		ret = -1;
+
+	pthread_mutex_lock(&w.lock);
+	if (!ret && !watch_stop)
+		json_object_set_new(w.manifest, "complete", json_true());
+	w.dirty = true;
+	pthread_mutex_unlock(&w.lock);
+
+	if (write_manifest(&w))
+		ret = -1;
+out_close:
+	close(ifd);
+out:
+	json_decref(w.js_prev);
+	json_decref(w.js_rerun);
+	json_decref(w.js_images);
+	json_decref(w.manifest);
+	return ret;
+}